@@ -0,0 +1,86 @@
+#pragma once
+
+#include "hufftree.h"
+#include "bitio.h"
+#include <cstdint>
+#include <climits>
+#include <vector>
+#include <span>
+
+namespace huff_tree {
+
+using bit_io::BitInputStream;
+using bit_io::BitOutputStream;
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Adaptive Huffman code (FGK): the tree is a Huffman tree of the chars coded so far and is updated
+// after every one of them, so the encoder and the decoder build the same trees and no tree is sent.
+// A char seen for the first time is coded as the code of the NYT leaf followed by SYMBOL_BITS bits
+// of the char; the same escape with END after it ends the stream.
+// Nodes are numbered so that the weights never decrease with the numbers and siblings have adjacent
+// numbers; an update swaps a node with the highest numbered node of its weight before incrementing it.
+class AdaptiveHuffTree {
+public:
+	static constexpr unsigned SYMBOL_BITS = CHAR_BIT + 1;
+	static constexpr size_t END = CHARS_CNT;
+
+	AdaptiveHuffTree();
+	~AdaptiveHuffTree();
+
+	// back to the tree of no chars
+	void reset();
+
+	// writes the code of a char or END and updates the tree, returns the number of bits written
+	size_t encode(size_t symbol, BitOutputStream &bo);
+	// reads the code of a char or END and updates the tree, len is set to the length of the code
+	size_t decode(BitInputStream &bi, size_t &len);
+	// the same for a code starting at bit pos of data; false if data ends first, nothing is changed then
+	bool decode(std::span <const unsigned char> data, size_t &pos, size_t &symbol);
+
+private:
+	static constexpr size_t MAX_NODES_CNT = (CHARS_CNT + 1) * 2 - 1;
+	static constexpr uint16_t NONE = UINT16_MAX;
+
+	struct Node {
+		size_t weight = 0;
+		uint16_t parent = NONE, l = NONE, r = NONE;
+		// the number of the node in the order of weights
+		uint16_t number = 0;
+		uint16_t symbol = 0;
+	};
+
+	std::vector <Node> nodes;
+	uint16_t by_number[MAX_NODES_CNT];
+	uint16_t leaf[CHARS_CNT];
+	uint16_t root = 0, nyt = 0;
+
+	// read_bit is called for every next bit of the code; an escape of a char that has a leaf
+	// or of a symbol past END gives a symbol past END
+	template <class ReadBit>
+	size_t read_symbol(ReadBit read_bit) const;
+	void update(size_t symbol);
+	uint16_t add_node(uint16_t parent, uint16_t symbol);
+	void swap_nodes(uint16_t a, uint16_t b);
+};
+
+template <class ReadBit>
+size_t AdaptiveHuffTree::read_symbol(ReadBit read_bit) const {
+	uint16_t v = root;
+	while (nodes[v].l != NONE) {
+		v = read_bit() ? nodes[v].r : nodes[v].l;
+	}
+	if (v != nyt) {
+		return nodes[v].symbol;
+	}
+
+	size_t symbol = 0;
+	for (unsigned i = 0; i < SYMBOL_BITS; i++) {
+		symbol |= (size_t)read_bit() << i;
+	}
+	return symbol < END && leaf[symbol] != NONE ? END + 1 : symbol;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+}
\ No newline at end of file
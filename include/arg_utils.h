@@ -5,15 +5,25 @@
 
 namespace arg_utils {
 
+// the file name standing for stdin or stdout
+const std::string_view STDIO_FILE = "-";
+
 struct Arguments {
 public:
 	std::string_view get_target();
 	std::string_view get_input_file();
 	std::string_view get_output_file();
+	bool has_format();
+	std::string_view get_format();
+	std::string_view get_max_code_len();
+	std::string_view get_threads();
 
 	void set_target(const std::string_view &tg);
 	void set_input_file(const std::string_view &inf);
 	void set_output_file(const std::string_view &ouf);
+	void set_format(const std::string_view &fmt);
+	void set_max_code_len(const std::string_view &len);
+	void set_threads(const std::string_view &cnt);
 
 	friend Arguments process_args(int argc, const char **argv);
 
@@ -21,6 +31,9 @@ private:
 	std::optional <std::string_view> target;
 	std::optional <std::string_view> input_file;
 	std::optional <std::string_view> output_file;
+	std::optional <std::string_view> format;
+	std::optional <std::string_view> max_code_len;
+	std::optional <std::string_view> threads;
 };
 
 Arguments process_args(int argc, const char **argv);
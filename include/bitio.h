@@ -1,43 +1,135 @@
 #pragma once
 
-#include <iosfwd>
+#include <ios>
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <span>
 
 namespace bit_io {
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// Reads bits in the same LSB-first order BitOutputStream writes them. The stream is read in large
+// blocks and up to 64 bits are kept in a bit buffer, so a decoder can look at many bits at once.
+// Input that is already in memory is read in place, without a stream and without copying.
 class BitInputStream {
 public:
+	static constexpr unsigned MAX_PEEK_BITS = 57;
+
 	BitInputStream(std::istream &_in);
+	BitInputStream(std::span <const unsigned char> _data);
 	~BitInputStream();
 
 	bool read_bit();
+	// next n bits (n <= MAX_PEEK_BITS) without consuming them, zero-padded past the end of input
+	uint64_t peek_bits(unsigned n);
+	void consume(unsigned n);
+	uint64_t read_bits(unsigned n);
+	// copies whole bytes, the bits read so far have to end on a byte boundary
+	void read_bytes(std::span <unsigned char> out);
+	// skips whole bytes, with the same requirement
+	void skip_bytes(size_t n);
+	// bits that are already buffered and can be consumed without touching the stream
+	size_t bits_remaining() const;
+	// whether every bit of the input is consumed
+	bool at_end();
 
 private:
-	std::istream &in;
-	char buffer, bit_mask;
-	unsigned char buf_pos;
+	static constexpr size_t BUFFER_SZ = 1 << 16;
+
+	// nullptr when reading from memory
+	std::istream *in;
+	uint64_t bit_buf;
+	unsigned bit_cnt;
+	std::vector <char> buffer;
+	// either the buffer or the memory being read
+	const unsigned char *data;
+	size_t buf_pos, buf_end;
 
-	void update_buffer();
+	void refill();
+	bool update_buffer();
 };
 
+inline uint64_t BitInputStream::peek_bits(unsigned n) {
+	if (bit_cnt < n) {
+		refill();
+	}
+	return bit_buf & (((uint64_t)1 << n) - 1);
+}
+
+inline void BitInputStream::consume(unsigned n) {
+	if (bit_cnt < n) {
+		refill();
+		if (bit_cnt < n) {
+			throw std::ios_base::failure("no bits left in input");
+		}
+	}
+	bit_buf >>= n; bit_cnt -= n;
+}
+
+inline uint64_t BitInputStream::read_bits(unsigned n) {
+	uint64_t result = peek_bits(n);
+	consume(n);
+	return result;
+}
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// Bits are packed LSB-first: the first bit written becomes the lowest bit of the first byte.
+// They are collected in a 64-bit accumulator and whole words are moved to an internal buffer,
+// which goes to the stream in large chunks. Output to memory skips the buffer and the stream,
+// the memory has to be large enough for everything written. The destructor flushes too but keeps
+// errors to itself, so output to memory has to be flushed explicitly to learn that it didn't fit.
 class BitOutputStream {
 public:
 	BitOutputStream(std::ostream &_out);
+	BitOutputStream(std::span <unsigned char> _data);
 	~BitOutputStream();
 
 	void write_bit(bool bit);
+	// writes the lowest len bits of bits (len <= 64), lowest bit first
+	void write_bits(uint64_t bits, unsigned len);
+	// pads the last byte with zero bits and writes everything buffered to the stream
+	void flush();
+	// writes every whole byte to the stream, the bits of the last partial byte are kept
+	void flush_bytes();
 
 private:
-	std::ostream &out;
-	char buffer, bit_mask;
-	unsigned char buf_pos;
+	static constexpr size_t WORD_BITS = 64;
+	static constexpr size_t BUFFER_SZ = 1 << 16;
+
+	// nullptr when writing to memory
+	std::ostream *out;
+	uint64_t acc;
+	unsigned acc_bits;
+	std::vector <char> buffer;
+	// either the buffer or the memory being written
+	unsigned char *data;
+	size_t buf_pos, buf_cap;
 
+	void release_word();
 	void release_buffer();
+	// makes room for sz more bytes
+	void reserve(size_t sz);
 };
 
+inline void BitOutputStream::write_bits(uint64_t bits, unsigned len) {
+	if (len < WORD_BITS) {
+		bits &= ((uint64_t)1 << len) - 1;
+	}
+	acc |= bits << acc_bits;
+	if (acc_bits + len < WORD_BITS) {
+		acc_bits += len;
+		return;
+	}
+
+	release_word();
+	unsigned taken = WORD_BITS - acc_bits;
+	acc = taken < WORD_BITS ? bits >> taken : 0;
+	acc_bits = len - taken;
+}
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 }
\ No newline at end of file
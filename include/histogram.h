@@ -0,0 +1,32 @@
+#pragma once
+
+#include "hufftree.h"
+#include <cstddef>
+
+namespace huff_tree {
+
+using std::size_t;
+
+// A histogram kernel adds the number of occurrences of every char of buf to cnt[CHARS_CNT].
+// sz must stay below 2^32.
+using HistogramKernel = void (*)(const unsigned char *buf, size_t sz, size_t *cnt);
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HUFF_HISTOGRAM_X86
+#endif
+
+void histogram_scalar(const unsigned char *buf, size_t sz, size_t *cnt);
+
+#ifdef HUFF_HISTOGRAM_X86
+// Vector kernels compare whole vectors with their first char and count a run of one char
+// with a single increment; the other vectors are counted like in the scalar kernel. They only
+// win on long runs of one char and lose to the scalar kernel on mixed data, so nothing picks them.
+void histogram_sse2(const unsigned char *buf, size_t sz, size_t *cnt);
+void histogram_avx2(const unsigned char *buf, size_t sz, size_t *cnt);
+bool avx2_supported();
+#endif
+
+// the kernel used for counting, the scalar one on every CPU
+HistogramKernel get_histogram_kernel();
+
+}
\ No newline at end of file
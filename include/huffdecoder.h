@@ -0,0 +1,82 @@
+#pragma once
+
+#include "hufftree.h"
+#include "bitio.h"
+#include <cstdint>
+#include <iosfwd>
+#include <vector>
+#include <span>
+
+namespace huff_tree {
+
+using bit_io::BitInputStream;
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Decodes a whole char with one lookup of the next TABLE_BITS bits. Codes longer than that
+// resolve to the tree node reached after TABLE_BITS bits and are finished by walking the tree.
+// When the codes are short enough, a second table maps MULTI_TABLE_BITS bits to up to
+// MULTI_MAX_CHARS chars at once.
+class HuffDecoder {
+public:
+	static constexpr unsigned TABLE_BITS = 11;
+	static constexpr unsigned MULTI_TABLE_BITS = 12;
+	static constexpr unsigned MULTI_MAX_CHARS = 4;
+	// the number of interleaved streams with a decoding loop of their own
+	static constexpr size_t FAST_STREAMS_CNT = 4;
+
+	HuffDecoder();
+	~HuffDecoder();
+
+	void rebuild(const HuffTree &htree);
+
+	// decodes exactly input_sz bits from bi into out, returns the number of chars written
+	size_t decode(BitInputStream &bi, size_t input_sz, std::ostream &out) const;
+	// same, but the chars must fit into out
+	size_t decode(BitInputStream &bi, size_t input_sz, std::span <unsigned char> out) const;
+	// decodes several streams in memory in turns, so that the lookups of one don't wait for the others;
+	// each one is decoded from exactly input_sz bits and has to fill its out exactly
+	void decode_interleaved(std::span <const std::span <const unsigned char>> in, std::span <const size_t> input_sz,
+	                        std::span <const std::span <unsigned char>> out) const;
+	// decodes from a stream of which bits_left bits are left but only the first avail_bits of them are in bi;
+	// stops when out is full or the next code might not be all in bi, returns the number of chars written
+	size_t decode_partial(BitInputStream &bi, size_t &bits_left, size_t avail_bits, std::span <unsigned char> out) const;
+
+	bool uses_multi_table() const;
+
+private:
+	struct Entry {
+		uint16_t node = HuffTree::Node::NONE;
+		unsigned char ch = 0;
+		unsigned char len = 0;
+	};
+
+	struct MultiEntry {
+		unsigned char ch[MULTI_MAX_CHARS]{};
+		unsigned char cnt = 0;
+		unsigned char len = 0;
+	};
+
+	// a copy of the tree for the rest of long codes, so that moving whatever owns the tree is safe
+	std::vector <HuffTree::Node> nodes;
+	std::vector <Entry> table;
+	std::vector <MultiEntry> multi_table;
+	// sum of len * 2^-len over all codes, i.e. the mean code length the tree was built for
+	double expected_len = 0;
+	// the longest code, at least 1
+	unsigned max_len = 1;
+
+	// decodes until bits_left is zero or out_sz chars are written, returns the number of chars
+	size_t decode_block(BitInputStream &bi, size_t &bits_left, unsigned char *out, size_t out_sz) const;
+	template <size_t N, bool MULTI>
+	size_t decode_turns(const unsigned char **data, size_t *bit_pos, unsigned char **dst, size_t turns, size_t &stalled) const;
+
+	void fill_table(uint16_t v, size_t code, unsigned depth);
+	// the length of the longest path down from v
+	unsigned get_height(uint16_t v) const;
+	void build_multi_table();
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+}
\ No newline at end of file
@@ -1,4 +1,6 @@
 #pragma once
 
 #include "huffman_archiver.h"
-#include "huffman_dearchiver.h"
\ No newline at end of file
+#include "huffman_dearchiver.h"
+#include "huffman_buffer.h"
+#include "huffman_incremental.h"
\ No newline at end of file
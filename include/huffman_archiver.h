@@ -1,29 +1,138 @@
 #pragma once
 
 #include "hufftree.h"
+#include "adaptive_hufftree.h"
 #include "huffman_util.h"
 #include "bitio.h"
 #include <iosfwd>
+#include <span>
+#include <string>
+#include <vector>
 
 namespace huffman {
 
 using std::size_t;
 using huff_tree::CharCounter;
 using huff_tree::HuffTree;
+using huff_tree::PackedCode;
+using huff_tree::AdaptiveHuffTree;
 using bit_io::BitOutputStream;
 
 class HuffmanArchiver {
 public:
+	static constexpr size_t DEFAULT_BLOCK_SZ = 1 << 20;
+
+	// single-tree formats read the input twice, so it has to be seekable; blocks formats read
+	// it once, a batch of at most 8 blocks at a time whatever the number of threads,
+	// and the periodic format a window at a time;
+	// the adaptive format encodes whatever part of the input has arrived and passes its code on right away
 	HuffFileData archive(std::istream &in, std::ostream &out);
+	// counts and encodes the chars in place, so in can be a mapped file
+	HuffFileData archive(std::span <const unsigned char> in, std::ostream &out);
+	// writes the archive straight into memory, asking for exactly its size
+	HuffFileData archive(std::span <const unsigned char> in, const OutputProvider &get_output);
+
+	void set_format(ArchiveFormat fmt);
+	// 0 means no limit; the legacy format needs at least CHAR_BIT since its tree has every char
+	void set_max_code_len(size_t len);
+	// blocks and interleaved formats only: the size of the blocks the input is split into
+	void set_block_sz(size_t sz);
+	// periodic format only: the tree is rebuilt after every window of this size, the first few are smaller
+	void set_window_sz(size_t sz);
+	// interleaved format only: the number of bitstreams a block is split into
+	void set_streams_cnt(size_t cnt);
+	// the number of threads counting an input in memory and compressing blocks, 0 for one per core
+	void set_threads_cnt(size_t cnt);
 
 private:
+	static constexpr size_t BUFFER_SZ = 1 << 16;
+	static constexpr size_t DEFAULT_STREAMS_CNT = 4;
+	static constexpr size_t DEFAULT_WINDOW_SZ = 1 << 14;
+	static constexpr size_t FIRST_WINDOW_SZ = 1 << 10;
+	// the limit of the periodic format trees unless max_code_len is set
+	static constexpr size_t DEFAULT_WINDOW_CODE_LEN = 12;
+	// blocks compressed at once per thread when the archive goes to a stream
+	static constexpr size_t BATCH_BLOCKS_PER_THREAD = 4;
+	// but no more than this in all, so a batch and its archive stay within a few block sizes on any machine
+	static constexpr size_t MAX_BATCH_BLOCKS = 8;
+	// inputs in memory are counted and encoded in parallel by chunks of this size
+	static constexpr size_t CHUNK_SZ = 1 << 20;
+
+	// a block of the blocks format, counted and with its header written
+	struct BlockPlan {
+		std::vector <unsigned char> code_len;
+		std::string header;
+		// the size of every bitstream in bytes, and of all of them
+		std::vector <size_t> streams_sz;
+		size_t payload_sz = 0;
+		// the chars are copied as they are, see BLOCK_STORED
+		bool stored = false;
+	};
+	// an entry of the index of the blocks format
+	struct BlockIndexEntry {
+		size_t archive_sz = 0;
+		size_t chars_cnt = 0;
+	};
+
 	HuffTree htree;
+	ArchiveFormat format = ArchiveFormat::LEGACY;
+	size_t max_code_len = 0;
+	size_t block_sz = DEFAULT_BLOCK_SZ;
+	size_t streams_cnt = DEFAULT_STREAMS_CNT;
+	size_t window_sz = DEFAULT_WINDOW_SZ;
+	size_t threads_cnt = 0;
+
+	bool uses_blocks() const;
+	HuffFileData archive_adaptive(std::istream &in, std::ostream &out) const;
+	HuffFileData archive_adaptive(std::span <const unsigned char> in, std::ostream &out) const;
+	// returns the size of the code in bits
+	size_t encode_adaptive(AdaptiveHuffTree &tree, std::span <const unsigned char> data, BitOutputStream &bo) const;
+	HuffFileData archive_periodic(std::istream &in, std::ostream &out);
+	HuffFileData archive_periodic(std::span <const unsigned char> in, std::ostream &out);
+	HuffFileData archive_periodic(std::span <const unsigned char> in, const OutputProvider &get_output);
+	HuffFileData encode_periodic(std::span <const unsigned char> in, BitOutputStream &bo);
+	size_t save_periodic_header(BitOutputStream &bo);
+	// writes the window with the current tree, then builds the tree of its counts for the next one
+	void compress_window(std::span <const unsigned char> window, BitOutputStream &bo, HuffFileData &result);
+	size_t get_next_window_sz(size_t sz) const;
+	size_t get_window_code_len() const;
+	HuffFileData archive_blocks(std::istream &in, std::ostream &out) const;
+	HuffFileData archive_blocks(std::span <const unsigned char> in, std::ostream &out) const;
+	HuffFileData archive_blocks(std::span <const unsigned char> in, const OutputProvider &get_output) const;
+	void compress_blocks(std::span <const unsigned char> data, std::ostream &out, std::vector <BlockIndexEntry> &index, HuffFileData &result) const;
+	// returns where every block starts in the output, and where the last one ends
+	std::vector <size_t> plan_blocks(std::span <const unsigned char> data, std::vector <BlockPlan> &plans, std::vector <BlockIndexEntry> &index, HuffFileData &result) const;
+	void plan_block(std::span <const unsigned char> block, BlockPlan &plan) const;
+	void plan_stored_block(std::span <const unsigned char> block, BlockPlan &plan) const;
+	void encode_blocks(std::span <const unsigned char> data, const std::vector <BlockPlan> &plans, const std::vector <size_t> &offsets, std::span <unsigned char> out) const;
+	std::span <const unsigned char> get_block(std::span <const unsigned char> data, size_t i) const;
+	size_t get_block_streams_cnt() const;
+	std::span <const unsigned char> get_segment(std::span <const unsigned char> block, size_t i) const;
+	size_t get_batch_sz() const;
 
+	void build_tree(const CharCounter &cnt);
+	size_t write_header(const CharCounter &cnt, BitOutputStream &bo) const;
 	void count_chars(std::istream &in, CharCounter &cnt) const;
+	// returns the counts of every chunk of the input
+	std::vector <CharCounter> count_chars(std::span <const unsigned char> in, CharCounter &cnt) const;
+	void compress_chunks(std::span <const unsigned char> in, const std::vector <CharCounter> &chunks_cnt, std::ostream &out) const;
+	void compress_chunks(std::span <const unsigned char> in, const std::vector <CharCounter> &chunks_cnt, std::span <unsigned char> out) const;
+	// returns where the code of every chunk starts in bits, and where the last one ends
+	std::vector <size_t> get_chunk_offsets(const std::vector <CharCounter> &chunks_cnt) const;
+	// encodes chunks [first, last) to out, which starts at the byte holding the first bit of the first one
+	void encode_chunks(std::span <const unsigned char> in, const std::vector <size_t> &offsets, size_t first, size_t last, std::span <unsigned char> out) const;
+	std::span <const unsigned char> get_chunk(std::span <const unsigned char> in, size_t i) const;
 	size_t save_tree(BitOutputStream &bo) const;
 	size_t compress_file(std::istream &in, BitOutputStream &bo) const;
-	size_t calc_file_size(const CharCounter &cnt) const;
+	void compress_block(const HuffTree &tree, const unsigned char *buf, size_t sz, BitOutputStream &bo) const;
+	size_t calc_file_size(const HuffTree &tree, const CharCounter &cnt) const;
 	void write_file_size(const CharCounter &cnt, BitOutputStream &bo) const;
+	size_t save_magic(BitOutputStream &bo) const;
+	size_t save_header(const CharCounter &cnt, BitOutputStream &bo) const;
+	size_t save_code_lengths(const HuffTree &tree, BitOutputStream &bo) const;
+	size_t save_blocks_end(const std::vector <BlockIndexEntry> &index, BitOutputStream &bo) const;
+	size_t write_varint(size_t x, BitOutputStream &bo) const;
+	size_t get_varint_sz(size_t x) const;
 };
 
 }
\ No newline at end of file
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "huffman_util.h"
+#include <cstddef>
+#include <span>
+#include <vector>
+
+namespace huffman {
+
+using std::size_t;
+
+// Archiving of buffers that are already in memory. The output vector is resized to the exact size
+// of the result and written in place; the input isn't copied.
+
+// the largest archive of n bytes in any format but the adaptive and periodic ones, for preallocating
+// output buffers; their codes may take more than CHAR_BIT bits per char for data that doesn't compress
+size_t compress_bound(size_t n);
+
+HuffFileData compress(std::span <const std::byte> in, std::vector <std::byte> &out, ArchiveFormat format = ArchiveFormat::LEGACY, size_t max_code_len = 0);
+HuffFileData decompress(std::span <const std::byte> in, std::vector <std::byte> &out);
+
+}
\ No newline at end of file
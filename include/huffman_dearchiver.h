@@ -1,27 +1,97 @@
 #pragma once
 
 #include "hufftree.h"
+#include "huffdecoder.h"
+#include "adaptive_hufftree.h"
 #include "huffman_util.h"
 #include "bitio.h"
 #include <iosfwd>
+#include <span>
+#include <vector>
 
 namespace huffman {
 
 using std::size_t;
 using huff_tree::HuffTree;
+using huff_tree::CharCounter;
+using huff_tree::HuffDecoder;
+using huff_tree::AdaptiveHuffTree;
 using bit_io::BitInputStream;
 
 class HuffmanDearchiver {
 public:
 	HuffFileData dearchive(std::istream &in, std::ostream &out);
+	HuffFileData dearchive(std::span <const unsigned char> in, std::ostream &out);
+	// decodes into memory asked for once; legacy archives don't store the number of chars, so for them
+	// it's only an upper bound, and adaptive ones are decoded aside first to learn it
+	HuffFileData dearchive(std::span <const unsigned char> in, const OutputProvider &get_output);
+
+	// blocks archives in memory only: the number of threads decoding blocks, 0 for one per core
+	void set_threads_cnt(size_t cnt);
 
 private:
+	// reads the headers with the same code
+	friend class IncrementalDearchiver;
+
+	static constexpr size_t BUFFER_SZ = 1 << 16;
+	// blocks decoded at once per thread when the output is a stream
+	static constexpr size_t BATCH_BLOCKS_PER_THREAD = 4;
+
+	// the header of a block of a blocks archive; the payload is one bitstream per segment
+	// in interleaved archives and a single one otherwise
+	struct BlockHeader {
+		size_t chars_cnt = 0;
+		std::vector <unsigned char> code_len;
+		std::vector <size_t> streams_bits;
+		size_t payload_bits = 0;
+		size_t payload_sz = 0;
+		size_t sz = 0;
+		// the chars are stored as they are, see BLOCK_STORED
+		bool stored = false;
+	};
+
 	HuffTree htree;
+	HuffDecoder decoder;
+	size_t threads_cnt = 0;
+
+	// Output is either std::ostream or const OutputProvider
+	template <class Output>
+	HuffFileData dearchive(BitInputStream &bi, Output &out);
+	template <class Output>
+	HuffFileData dearchive_legacy(BitInputStream &bi, Output &out);
+	template <class Output>
+	HuffFileData dearchive_canonical(BitInputStream &bi, Output &out);
+	HuffFileData dearchive_adaptive(BitInputStream &bi, std::ostream &out) const;
+	// every char takes at least a bit, so the output is at most as many chars as there are bits left
+	HuffFileData dearchive_adaptive(BitInputStream &bi, const OutputProvider &get_output) const;
+	// every window is decoded with the tree of the chars decoded from the one before
+	template <class Output>
+	HuffFileData dearchive_periodic(BitInputStream &bi, Output &out);
+	size_t read_window_code_len(BitInputStream &bi) const;
+	size_t count_window_chars(BitInputStream bi) const;
+	HuffFileData dearchive_blocks(BitInputStream &bi, ArchiveFormat format, std::ostream &out);
+	size_t check_blocks_index(BitInputStream &bi, const std::vector <size_t> &blocks_sz, const std::vector <size_t> &chars_cnt) const;
+	bool is_blocks_archive(std::span <const unsigned char> in) const;
+	// in starts right after the format version
+	HuffFileData dearchive_blocks(std::span <const unsigned char> in, ArchiveFormat format, std::ostream &out) const;
+	HuffFileData dearchive_blocks(std::span <const unsigned char> in, ArchiveFormat format, const OutputProvider &get_output) const;
+	// fills where every block starts in the input and in the output, and where the last one ends
+	void read_blocks_index(std::span <const unsigned char> in, std::vector <size_t> &offsets, std::vector <size_t> &out_offsets) const;
+	// decodes blocks [first, last) to out, which starts where the first one does; returns their payload size
+	size_t decode_blocks(std::span <const unsigned char> in, ArchiveFormat format, const std::vector <size_t> &offsets, const std::vector <size_t> &out_offsets,
+	                     size_t first, size_t last, std::span <unsigned char> out) const;
+	size_t decode_block(std::span <const unsigned char> block, ArchiveFormat format, std::span <unsigned char> out) const;
+	void read_block_header(BitInputStream &bi, ArchiveFormat format, BlockHeader &header) const;
+	void copy_stored_block(BitInputStream &bi, size_t sz, std::ostream &out) const;
 
-	std::vector <unsigned char> get_char_permutation_from_archive(std::istream &in) const;
+	std::vector <unsigned char> get_char_permutation_from_archive(BitInputStream &bi) const;
 	std::vector <bool> get_tree_tour(BitInputStream &bi) const;
 	size_t read_file_size(BitInputStream &bi) const;
-	size_t decompress_file(BitInputStream &bi, size_t input_sz, std::ostream &out) const;
+	size_t read_code_lengths(BitInputStream &bi, std::vector <unsigned char> &code_len) const;
+	size_t read_varint(BitInputStream &bi, size_t &x) const;
+	size_t get_max_chars_cnt(const HuffTree &tree, size_t input_sz) const;
+	size_t decompress_file(BitInputStream &bi, size_t input_sz, size_t max_chars_cnt, std::ostream &out) const;
+	size_t decompress_file(BitInputStream &bi, size_t input_sz, size_t max_chars_cnt, const OutputProvider &get_output) const;
 };
 
 }
\ No newline at end of file
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "huffman_dearchiver.h"
+#include "huffman_util.h"
+#include <cstddef>
+#include <span>
+#include <vector>
+
+namespace huffman {
+
+using std::size_t;
+
+// Decodes an archive of any format that arrives in pieces, like zlib's inflate: every call takes
+// as much of the input as it can use and fills as much of the output as it can, the bit position
+// and the code are kept between calls. At most BUFFER_SZ bytes of the input are held at once,
+// what follows the blocks of a blocks archive is kept until the end to be checked.
+class IncrementalDearchiver {
+public:
+	struct Progress {
+		size_t in_used = 0;
+		size_t out_used = 0;
+	};
+
+	Progress decode(std::span <const unsigned char> in, std::span <unsigned char> out);
+	// whether every char of the archive is decoded
+	bool done() const;
+	// tells that the input is over; throws if the archive is cut short
+	HuffFileData finish();
+
+private:
+	static constexpr size_t BUFFER_SZ = 1 << 16;
+
+	enum class State {
+		MAGIC,
+		LEGACY_HEADER,
+		CANONICAL_HEADER,
+		BLOCK_HEADER,
+		PERIODIC_HEADER,
+		WINDOW_HEADER,
+		PAYLOAD,
+		ADAPTIVE_PAYLOAD,
+		BLOCKS_INDEX,
+		DONE,
+	};
+
+	HuffmanDearchiver parser;
+	HuffTree htree;
+	HuffDecoder decoder;
+	State state = State::MAGIC;
+	ArchiveFormat format = ArchiveFormat::LEGACY;
+	HuffFileData result;
+
+	// input taken but not decoded yet, the next bit to read is at bit_pos
+	std::vector <unsigned char> buffer;
+	size_t bit_pos = 0;
+
+	// the bitstream being decoded; legacy archives don't store the number of chars, only its upper bound
+	size_t bits_left = 0, chars_left = 0;
+	bool exact_chars_cnt = true;
+	// the adaptive code and the number of bits decoded with it
+	AdaptiveHuffTree adaptive_tree;
+	size_t adaptive_bits = 0;
+
+	// the limit of the trees of a periodic archive and the counts of the window being decoded
+	size_t window_code_len = 0;
+	CharCounter window_cnt;
+
+	// the block being decoded and its segment, and all the blocks before it to check the index against
+	HuffmanDearchiver::BlockHeader block;
+	size_t segment = 0;
+	std::vector <size_t> blocks_sz, chars_cnt;
+	std::vector <unsigned char> index;
+
+	void take_input(std::span <const unsigned char> in, size_t &in_used);
+	// false when nothing can be done without more input or output
+	bool step(std::span <unsigned char> out, size_t &out_used);
+	// runs read on the buffered input, which starts at a byte; false if it runs out of input
+	template <class Read>
+	bool parse(Read read);
+	bool read_magic();
+	bool read_legacy_header();
+	bool read_canonical_header();
+	bool read_block_header();
+	void start_segment();
+	bool read_periodic_header();
+	bool read_window_header();
+	bool decode_payload(std::span <unsigned char> out, size_t &out_used);
+	bool copy_stored(std::span <unsigned char> out, size_t &out_used);
+	bool decode_adaptive(std::span <unsigned char> out, size_t &out_used);
+	void end_stream();
+};
+
+}
\ No newline at end of file
@@ -2,6 +2,8 @@
 
 #include <cstddef>
 #include <stdexcept>
+#include <functional>
+#include <span>
 
 namespace huffman {
 
@@ -21,4 +23,51 @@ struct HuffFileData {
 	HuffFileData(size_t in, size_t out, size_t add): input_sz(in), output_sz(out), additional_sz(add) {}
 };
 
+// Gives memory for output of at most sz bytes, called once the size is known and before anything
+// is written. The output may turn out shorter, its real size is returned in HuffFileData.
+using OutputProvider = std::function <std::span <unsigned char> (size_t sz)>;
+
+// Legacy archives have no header and start with a permutation of all chars. Every other format
+// starts with ARCHIVE_MAGIC followed by the format version byte; the magic repeats a byte,
+// so it can't be mistaken for the beginning of a permutation.
+// Blocks archives are a sequence of independently coded blocks, each one with its own canonical
+// code, ended by a block of no chars. An index of the blocks follows: their number, the size
+// in the archive and the number of chars of every block, then the size of the index
+// in BLOCKS_INDEX_SIZE_BYTES bytes and ARCHIVE_MAGIC, so the index can be found from the end.
+// A block that wouldn't get any smaller is stored as it is instead, see BLOCK_STORED.
+// Interleaved archives are blocks archives whose blocks are cut into several segments coded
+// as separate bitstreams; the header of a block lists the sizes of all of them in bits.
+// Adaptive archives have no header past the version: the code of every char is built from the chars
+// before it, see huff_tree::AdaptiveHuffTree, and the stream ends with its END symbol.
+// Periodic archives store the limit of their code lengths past the version, then windows ended
+// by a window of no chars: the number of chars, the size of the code in bits and the code padded
+// to a byte. No tree is stored: every window is coded with the tree of the chars of the one before.
+enum class ArchiveFormat : unsigned char {
+	LEGACY = 0,
+	CANONICAL = 1,
+	BLOCKS = 2,
+	INTERLEAVED = 3,
+	ADAPTIVE = 4,
+	PERIODIC = 5,
+};
+
+const char ARCHIVE_MAGIC[] = {'H', 'U', 'F', 'F'};
+const size_t ARCHIVE_MAGIC_SZ = sizeof(ARCHIVE_MAGIC);
+
+const size_t BLOCKS_INDEX_SIZE_BYTES = 8;
+
+// the number of chars in every segment of a block of an interleaved archive but the last one
+inline size_t get_segment_sz(size_t chars_cnt, size_t streams_cnt) {
+	return (chars_cnt + streams_cnt - 1) / streams_cnt;
+}
+
+// flags of the canonical format header: code lengths take 4 bits instead of 8; only the lengths
+// of present chars are stored, which are listed explicitly or marked in a bitmap of all chars
+const unsigned char CANONICAL_NIBBLE_LENGTHS = 1;
+const unsigned char CANONICAL_CHAR_LIST = 2;
+const unsigned char CANONICAL_CHAR_BITMAP = 4;
+// takes the place of the code lengths flags of a block of a blocks archive that has no code:
+// its chars follow right after it as they are, in a single stream of the interleaved format too
+const unsigned char BLOCK_STORED = 8;
+
 }
\ No newline at end of file
@@ -4,6 +4,8 @@
 #include <climits>
 #include <vector>
 #include <array>
+#include <span>
+#include <utility>
 
 namespace huff_tree {
 
@@ -18,52 +20,92 @@ public:
 	~CharCounter();
 
 	void add_char(char ch);
+	void add_block(const unsigned char *buf, size_t sz);
+	// adds the counts of a part of the input counted apart
+	void merge(const CharCounter &other);
 
 	size_t get_char_cnt(unsigned char ch) const;
+	size_t get_total_cnt() const;
 
 private:
+	// keeps the 32-bit counters of the histogram kernels from overflowing
+	static constexpr size_t MAX_BLOCK_SZ = (size_t)1 << 30;
+
 	size_t char_cnt[CHARS_CNT]{};
 };
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// Code of a char packed into a word, first bit of the code in the lowest bit.
+// Only meaningful when len <= MAX_LEN.
+struct PackedCode {
+	static constexpr unsigned MAX_LEN = 64;
+
+	uint64_t code = 0;
+	uint8_t len = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// All nodes live in one array that is kept between rebuilds; children are referred to by index.
 class HuffTree {
 public:
 	HuffTree();
 	~HuffTree();
 
-	void rebuild(const CharCounter &ccntr);
+	// with present_only the tree has leaves only for chars that occur at least once;
+	// a nonzero max_code_len limits the code lengths, the limited code is canonical
+	void rebuild(const CharCounter &ccntr, bool present_only = false, size_t max_code_len = 0);
 	void rebuild(const std::vector <unsigned char> &ch_perm, const std::vector <bool> &tree);
+	// builds the canonical code for the given code lengths (CHARS_CNT of them, 0 for absent chars);
+	// with no chars at all the tree is a single node without a char
+	void rebuild_canonical(const std::vector <unsigned char> &code_len);
 
 	std::vector <bool> get_compressed_tree() const;
 	const std::vector <bool>& get_char_code(unsigned char ch) const;
+	std::vector <unsigned char> get_code_lengths() const;
+	// table of CHARS_CNT packed codes, indexed by char
+	const PackedCode* get_packed_codes() const;
 
 	class Node {
 	public:
-		Node *l, *r;
+		static constexpr uint16_t NONE = UINT16_MAX;
+
 		size_t weight;
+		uint16_t l, r;
 		unsigned char ch;
 
 		Node();
 		Node(size_t w, unsigned char c);
-		Node(Node *left, Node *right);
-		~Node();
 
 		bool term() const;
 	};
 
-	Node const * get_root() const;
+	uint16_t get_root() const;
+	const Node& get_node(uint16_t v) const;
+	// every node, indexed the same way as by get_node
+	std::span <const Node> get_nodes() const;
 
 private:
-	Node *root = nullptr;
+	static constexpr size_t MAX_NODES_CNT = CHARS_CNT * 2 - 1;
+
+	std::vector <Node> nodes;
+	uint16_t root = 0;
 	std::vector <bool> char_code[CHARS_CNT];
+	PackedCode packed_code[CHARS_CNT];
+
+	uint16_t add_node(size_t w = 0, unsigned char c = 0);
+	uint16_t add_parent(uint16_t left, uint16_t right);
+	// the weights of the roots while the tree is built, by their positions
+	class RootWeights;
+	std::pair <size_t, size_t> find_two_minimums(const RootWeights &weights, size_t sz) const;
 
-	std::pair <size_t, size_t> find_two_minimums(const std::array <Node*, CHARS_CNT> &roots, size_t sz) const;
+	std::vector <unsigned char> get_limited_code_lengths(const CharCounter &ccntr, bool present_only, size_t max_code_len) const;
 
 	void build_char_codes();
-	void build_char_codes_dfs(Node *v, std::vector <bool> &cur_code);
-	void get_tree_chars(Node *v, std::vector <bool> &chars) const;
-	void get_tree_tour(Node *v, std::vector <bool> &tree) const;
+	void build_char_codes_dfs(uint16_t v, std::array <bool, CHARS_CNT> &cur_code, size_t depth);
+	void get_tree_chars(uint16_t v, std::vector <bool> &chars) const;
+	void get_tree_tour(uint16_t v, std::vector <bool> &tree) const;
 };
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstddef>
+#include <span>
+
+namespace file_io {
+
+using std::size_t;
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Read-only mapping of a whole file, advised for sequential access. Files that can't be mapped
+// (pipes, devices, empty files, no mmap on the system) are left unmapped and have to be read
+// as streams instead.
+class MappedFile {
+public:
+	MappedFile(const char *path);
+	~MappedFile();
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool is_mapped() const;
+	std::span <const unsigned char> get_data() const;
+
+private:
+	void *addr;
+	size_t sz;
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Output file that is resized to its final size up front and written through a shared mapping.
+// Only regular files are opened; anything else has to be written as a stream instead.
+class MappedOutputFile {
+public:
+	MappedOutputFile(const char *path);
+	~MappedOutputFile();
+
+	MappedOutputFile(const MappedOutputFile&) = delete;
+	MappedOutputFile& operator=(const MappedOutputFile&) = delete;
+
+	bool is_open() const;
+	// sets the file size to _sz and maps the whole file
+	std::span <unsigned char> map(size_t _sz);
+	// unmaps the file and cuts it to its first _sz bytes
+	void close(size_t _sz);
+
+private:
+	int fd;
+	void *addr;
+	size_t sz;
+
+	void unmap();
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+}
\ No newline at end of file
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace parallel {
+
+using std::size_t;
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// what threads_cnt == 0 stands for: one thread per core
+inline size_t get_threads_cnt(size_t threads_cnt) {
+	if (threads_cnt == 0) {
+		threads_cnt = std::thread::hardware_concurrency();
+	}
+	return std::max(threads_cnt, (size_t)1);
+}
+
+// Calls f(i) for every i < n on up to threads_cnt threads, the calling one included. Indices are
+// handed out one at a time in increasing order, so uneven items balance out. After the first
+// exception no more indices are handed out, and it is rethrown once all the threads are done.
+template <class F>
+void parallel_for(size_t n, size_t threads_cnt, const F &f) {
+	std::atomic <size_t> next(0);
+	std::exception_ptr error;
+	std::mutex error_mutex;
+
+	auto worker = [&]() {
+		for (size_t i; (i = next++) < n; ) {
+			try {
+				f(i);
+			} catch (...) {
+				std::lock_guard <std::mutex> lock(error_mutex);
+				if (!error) {
+					error = std::current_exception();
+				}
+				next = n;
+			}
+		}
+	};
+
+	std::vector <std::thread> threads;
+	for (size_t t = 1; t < std::min(get_threads_cnt(threads_cnt), n); t++) {
+		threads.emplace_back(worker);
+	}
+	worker();
+	for (std::thread &t : threads) {
+		t.join();
+	}
+
+	if (error) {
+		std::rethrow_exception(error);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+}
\ No newline at end of file
@@ -0,0 +1,145 @@
+#include "adaptive_hufftree.h"
+#include "huffman_util.h"
+#include <algorithm>
+
+namespace huff_tree {
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+AdaptiveHuffTree::AdaptiveHuffTree() {
+	nodes.reserve(MAX_NODES_CNT);
+	reset();
+}
+
+AdaptiveHuffTree::~AdaptiveHuffTree() {}
+
+void AdaptiveHuffTree::reset() {
+	nodes.clear();
+	std::fill(leaf, leaf + CHARS_CNT, NONE);
+	root = nyt = add_node(NONE, END);
+}
+
+size_t AdaptiveHuffTree::encode(size_t symbol, BitOutputStream &bo) {
+	uint16_t v = symbol < END ? leaf[symbol] : NONE;
+	bool escape = v == NONE;
+	if (escape) {
+		v = nyt;
+	}
+
+	// the code is the path from the root, so it's collected from the leaf up
+	bool path[MAX_NODES_CNT];
+	size_t len = 0;
+	for (; v != root; v = nodes[v].parent) {
+		path[len++] = nodes[nodes[v].parent].r == v;
+	}
+	for (size_t i = len; i > 0; ) {
+		uint64_t bits = 0;
+		unsigned cnt = 0;
+		for (; i > 0 && cnt < sizeof(bits) * CHAR_BIT; cnt++) {
+			bits |= (uint64_t)path[--i] << cnt;
+		}
+		bo.write_bits(bits, cnt);
+	}
+
+	if (escape) {
+		bo.write_bits(symbol, SYMBOL_BITS);
+		len += SYMBOL_BITS;
+	}
+	if (symbol != END) {
+		update(symbol);
+	}
+	return len;
+}
+
+size_t AdaptiveHuffTree::decode(BitInputStream &bi, size_t &len) {
+	len = 0;
+	size_t symbol = read_symbol([&bi, &len]() {
+		len++;
+		return bi.read_bit();
+	});
+	if (symbol != END) {
+		update(symbol);
+	}
+	return symbol;
+}
+
+bool AdaptiveHuffTree::decode(std::span <const unsigned char> data, size_t &pos, size_t &symbol) {
+	// past the end the bits are read as zeros, and the result is thrown away
+	size_t cur = pos;
+	const size_t data_bits = data.size() * CHAR_BIT;
+	symbol = read_symbol([&data, &cur, data_bits]() {
+		bool bit = cur < data_bits && ((data[cur / CHAR_BIT] >> (cur % CHAR_BIT)) & 1);
+		cur++;
+		return bit;
+	});
+	if (cur > data_bits) {
+		return false;
+	}
+	pos = cur;
+	if (symbol != END) {
+		update(symbol);
+	}
+	return true;
+}
+
+void AdaptiveHuffTree::update(size_t symbol) {
+	if (symbol > END) {
+		throw huffman::invalid_file_format("invalid code in input file");
+	}
+	uint16_t q = leaf[symbol];
+
+	// a new char splits the NYT leaf into a new NYT and a leaf of the char, both of weight 0
+	if (q == NONE) {
+		uint16_t parent = nyt;
+		q = leaf[symbol] = add_node(parent, symbol);
+		nyt = add_node(parent, END);
+		nodes[parent].l = nyt;
+		nodes[parent].r = q;
+	}
+
+	for (;;) {
+		const size_t weight = nodes[q].weight;
+		size_t i = nodes[q].number;
+		while (i + 1 < MAX_NODES_CNT && nodes[by_number[i + 1]].weight == weight) {
+			i++;
+		}
+		uint16_t leader = by_number[i];
+		if (leader != q && leader != nodes[q].parent) {
+			swap_nodes(q, leader);
+		}
+
+		nodes[q].weight++;
+		if (q == root) {
+			break;
+		}
+		q = nodes[q].parent;
+	}
+}
+
+// a node gets a number lower than every node before it
+uint16_t AdaptiveHuffTree::add_node(uint16_t parent, uint16_t symbol) {
+	uint16_t v = nodes.size();
+	nodes.emplace_back();
+	nodes[v].parent = parent;
+	nodes[v].symbol = symbol;
+	nodes[v].number = MAX_NODES_CNT - 1 - v;
+	by_number[nodes[v].number] = v;
+	return v;
+}
+
+// swaps the subtrees of a and b, neither of which is above the other
+void AdaptiveHuffTree::swap_nodes(uint16_t a, uint16_t b) {
+	Node &pa = nodes[nodes[a].parent], &pb = nodes[nodes[b].parent];
+	uint16_t &slot_a = pa.l == a ? pa.l : pa.r;
+	uint16_t &slot_b = pb.l == b ? pb.l : pb.r;
+	std::swap(slot_a, slot_b);
+	std::swap(nodes[a].parent, nodes[b].parent);
+
+	std::swap(nodes[a].number, nodes[b].number);
+	by_number[nodes[a].number] = a;
+	by_number[nodes[b].number] = b;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+}
\ No newline at end of file
@@ -15,9 +15,25 @@ std::string_view Arguments::get_output_file() {
 	return output_file.value();
 }
 
+bool Arguments::has_format() {
+	return format.has_value();
+}
+
+std::string_view Arguments::get_format() {
+	return format.value_or("legacy");
+}
+
+std::string_view Arguments::get_max_code_len() {
+	return max_code_len.value_or("0");
+}
+
+std::string_view Arguments::get_threads() {
+	return threads.value_or("0");
+}
+
 void Arguments::set_target(const std::string_view &tg) {
 	if (target) {
-		throw std::invalid_argument("Multiple targets (-c or -u)");
+		throw std::invalid_argument("Multiple targets (-c, -a or -u)");
 	}
 	target = tg;
 }
@@ -36,12 +52,33 @@ void Arguments::set_output_file(const std::string_view &ouf) {
 	output_file = ouf;
 }
 
+void Arguments::set_format(const std::string_view &fmt) {
+	if (format) {
+		throw std::invalid_argument("Multiple archive formats (--format)");
+	}
+	format = fmt;
+}
+
+void Arguments::set_max_code_len(const std::string_view &len) {
+	if (max_code_len) {
+		throw std::invalid_argument("Multiple max code lengths (--max-code-len)");
+	}
+	max_code_len = len;
+}
+
+void Arguments::set_threads(const std::string_view &cnt) {
+	if (threads) {
+		throw std::invalid_argument("Multiple numbers of threads (--threads)");
+	}
+	threads = cnt;
+}
+
 Arguments process_args(int argc, const char **argv) {
 	Arguments result;
 	for (int i = 1; i < argc; i++) {
 		std::string_view cur(argv[i]);
 
-		if (cur == "-c" || cur == "-u") {
+		if (cur == "-c" || cur == "-a" || cur == "-u") {
 			result.set_target(cur);
 
 		} else if (cur == "-f" || cur == "--file") {
@@ -55,11 +92,29 @@ Arguments process_args(int argc, const char **argv) {
 				throw std::invalid_argument("Missing output file (-o)");
 			}
 			result.set_output_file(std::string_view(argv[i + 1]));
+
+		} else if (cur == "--format") {
+			if (i == argc - 1) {
+				throw std::invalid_argument("Missing archive format (--format)");
+			}
+			result.set_format(std::string_view(argv[i + 1]));
+
+		} else if (cur == "--max-code-len") {
+			if (i == argc - 1) {
+				throw std::invalid_argument("Missing max code length (--max-code-len)");
+			}
+			result.set_max_code_len(std::string_view(argv[i + 1]));
+
+		} else if (cur == "--threads") {
+			if (i == argc - 1) {
+				throw std::invalid_argument("Missing number of threads (--threads)");
+			}
+			result.set_threads(std::string_view(argv[i + 1]));
 		}
 	}
 
 	if (!result.target) {
-		throw std::invalid_argument("Missing target (-c or -u)");
+		throw std::invalid_argument("Missing target (-c, -a or -u)");
 	}
 	if (!result.input_file) {
 		throw std::invalid_argument("Missing input file (-f or --file)");
@@ -67,7 +122,7 @@ Arguments process_args(int argc, const char **argv) {
 	if (!result.output_file) {
 		throw std::invalid_argument("Missing output file (-o or --output)");
 	}
-	if (result.get_input_file() == result.get_output_file()) {
+	if (result.get_input_file() == result.get_output_file() && result.get_input_file() != STDIO_FILE) {
 		throw std::invalid_argument("Input and output files are the same");
 	}
 
@@ -2,59 +2,188 @@
 #include <iostream>
 #include <cassert>
 #include <climits>
+#include <cstring>
+#include <algorithm>
 
 namespace bit_io {
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-BitInputStream::BitInputStream(std::istream &_in): in(_in) {
-	update_buffer();
+BitInputStream::BitInputStream(std::istream &_in): in(&_in), bit_buf(0), bit_cnt(0), buffer(BUFFER_SZ), data(nullptr), buf_pos(0), buf_end(0) {
+	if (!update_buffer()) {
+		throw std::istream::failure("no bits left in input");
+	}
+}
+
+BitInputStream::BitInputStream(std::span <const unsigned char> _data): in(nullptr), bit_buf(0), bit_cnt(0), data(_data.data()), buf_pos(0), buf_end(_data.size()) {
+	if (_data.empty()) {
+		throw std::istream::failure("no bits left in input");
+	}
 }
 
 BitInputStream::~BitInputStream() {}
 
 bool BitInputStream::read_bit() {
-	assert(buf_pos <= CHAR_BIT);
-	if (buf_pos == CHAR_BIT) {
-		update_buffer();
+	if (bit_cnt == 0) {
+		refill();
+		if (bit_cnt == 0) {
+			throw std::istream::failure("no bits left in input");
+		}
 	}
-	bool result = buffer & bit_mask;
-	bit_mask <<= 1; buf_pos++;
+	bool result = bit_buf & 1;
+	bit_buf >>= 1; bit_cnt--;
 	return result;
 }
 
-void BitInputStream::update_buffer() {
-	if (!in.read(&buffer, 1)) {
-		throw std::istream::failure("no bits left in input");
+void BitInputStream::read_bytes(std::span <unsigned char> out) {
+	assert(bit_cnt % CHAR_BIT == 0);
+	size_t pos = 0;
+	for (; pos < out.size() && bit_cnt > 0; pos++) {
+		out[pos] = bit_buf;
+		bit_buf >>= CHAR_BIT; bit_cnt -= CHAR_BIT;
+	}
+	// the bytes past bit_cnt that a word refill leaves in bit_buf are copied below instead
+	if (bit_cnt == 0) {
+		bit_buf = 0;
+	}
+
+	while (pos < out.size()) {
+		if (buf_pos == buf_end && !update_buffer()) {
+			throw std::istream::failure("no bits left in input");
+		}
+		size_t sz = std::min(out.size() - pos, buf_end - buf_pos);
+		std::memcpy(out.data() + pos, data + buf_pos, sz);
+		pos += sz; buf_pos += sz;
 	}
-	bit_mask = 1; buf_pos = 0;
+}
+
+void BitInputStream::skip_bytes(size_t n) {
+	assert(bit_cnt % CHAR_BIT == 0);
+	for (; n > 0 && bit_cnt > 0; n--) {
+		bit_buf >>= CHAR_BIT; bit_cnt -= CHAR_BIT;
+	}
+	if (bit_cnt == 0) {
+		bit_buf = 0;
+	}
+
+	while (n > 0) {
+		if (buf_pos == buf_end && !update_buffer()) {
+			throw std::istream::failure("no bits left in input");
+		}
+		size_t sz = std::min(n, buf_end - buf_pos);
+		n -= sz; buf_pos += sz;
+	}
+}
+
+size_t BitInputStream::bits_remaining() const {
+	return bit_cnt + (buf_end - buf_pos) * CHAR_BIT;
+}
+
+bool BitInputStream::at_end() {
+	if (bit_cnt == 0) {
+		refill();
+	}
+	return bit_cnt == 0;
+}
+
+void BitInputStream::refill() {
+	const unsigned word_bits = sizeof(bit_buf) * CHAR_BIT;
+	assert(bit_cnt < word_bits);
+
+	if (buf_end - buf_pos >= sizeof(bit_buf)) {
+		// whole word at once; the bits above bit_cnt it leaves in bit_buf
+		// are the same ones the next refill will put there
+		uint64_t word = 0;
+		for (size_t i = 0; i < sizeof(word); i++) {
+			word |= (uint64_t)data[buf_pos + i] << (i * CHAR_BIT);
+		}
+		bit_buf |= word << bit_cnt;
+		unsigned bytes = (word_bits - bit_cnt) / CHAR_BIT;
+		buf_pos += bytes; bit_cnt += bytes * CHAR_BIT;
+		return;
+	}
+
+	while (bit_cnt + CHAR_BIT <= word_bits) {
+		if (buf_pos == buf_end && !update_buffer()) {
+			return;
+		}
+		bit_buf |= (uint64_t)data[buf_pos++] << bit_cnt;
+		bit_cnt += CHAR_BIT;
+	}
+}
+
+bool BitInputStream::update_buffer() {
+	if (!in) {
+		return false;
+	}
+	in->read(buffer.data(), BUFFER_SZ);
+	data = (const unsigned char*)buffer.data();
+	buf_pos = 0; buf_end = in->gcount();
+	return buf_end > 0;
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-BitOutputStream::BitOutputStream(std::ostream &_out): out(_out), buffer(0), bit_mask(1), buf_pos(0) {}
+BitOutputStream::BitOutputStream(std::ostream &_out): out(&_out), acc(0), acc_bits(0), buffer(BUFFER_SZ), data((unsigned char*)buffer.data()), buf_pos(0), buf_cap(BUFFER_SZ) {}
 
+BitOutputStream::BitOutputStream(std::span <unsigned char> _data): out(nullptr), acc(0), acc_bits(0), data(_data.data()), buf_pos(0), buf_cap(_data.size()) {}
+
+// a destructor can't report that the output is too small, so output to memory is flushed explicitly
 BitOutputStream::~BitOutputStream() {
-	release_buffer();
+	try {
+		flush();
+	} catch (std::ios_base::failure &e) {
+	}
 }
 
 void BitOutputStream::write_bit(bool bit) {
-	assert(buf_pos <= CHAR_BIT);
-	if (buf_pos == CHAR_BIT) {
-		release_buffer();
+	write_bits(bit, 1);
+}
+
+void BitOutputStream::flush() {
+	while (acc_bits > 0) {
+		reserve(1);
+		data[buf_pos++] = (unsigned char)(acc & UCHAR_MAX);
+		acc >>= CHAR_BIT;
+		acc_bits = acc_bits > CHAR_BIT ? acc_bits - CHAR_BIT : 0;
+	}
+	acc = 0;
+	release_buffer();
+}
+
+void BitOutputStream::flush_bytes() {
+	while (acc_bits >= CHAR_BIT) {
+		reserve(1);
+		data[buf_pos++] = (unsigned char)(acc & UCHAR_MAX);
+		acc >>= CHAR_BIT;
+		acc_bits -= CHAR_BIT;
 	}
-	if (bit) {
-		buffer |= bit_mask;
+	release_buffer();
+}
+
+void BitOutputStream::release_word() {
+	reserve(sizeof(acc));
+	for (size_t i = 0; i < sizeof(acc); i++) {
+		data[buf_pos++] = (unsigned char)((acc >> (i * CHAR_BIT)) & UCHAR_MAX);
 	}
-	bit_mask <<= 1; buf_pos++;
 }
 
 void BitOutputStream::release_buffer() {
-	if (!buf_pos) {
+	if (!buf_pos || !out) {
 		return;
 	}
-	out.write(&buffer, 1);
-	bit_mask = 1; buf_pos = 0; buffer = 0;
+	out->write(buffer.data(), buf_pos);
+	buf_pos = 0;
+}
+
+void BitOutputStream::reserve(size_t sz) {
+	if (buf_pos + sz <= buf_cap) {
+		return;
+	}
+	release_buffer();
+	if (buf_pos + sz > buf_cap) {
+		throw std::ostream::failure("no space left in output");
+	}
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
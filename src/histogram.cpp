@@ -0,0 +1,95 @@
+#include "histogram.h"
+#include <cstdint>
+
+#ifdef HUFF_HISTOGRAM_X86
+#include <immintrin.h>
+#endif
+
+namespace huff_tree {
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace {
+
+// consecutive chars go to different tables, so a run of one char doesn't serialize on one counter
+constexpr size_t SUB_TABLES_CNT = 4;
+
+using SubTables = uint32_t[SUB_TABLES_CNT][CHARS_CNT];
+
+inline void count_chars(const unsigned char *buf, size_t sz, SubTables &sub_cnt) {
+	size_t i = 0;
+	for (; i + SUB_TABLES_CNT <= sz; i += SUB_TABLES_CNT) {
+		sub_cnt[0][buf[i]]++;
+		sub_cnt[1][buf[i + 1]]++;
+		sub_cnt[2][buf[i + 2]]++;
+		sub_cnt[3][buf[i + 3]]++;
+	}
+	for (; i < sz; i++) {
+		sub_cnt[0][buf[i]]++;
+	}
+}
+
+inline void merge_sub_tables(const SubTables &sub_cnt, size_t *cnt) {
+	for (size_t c = 0; c < CHARS_CNT; c++) {
+		cnt[c] += (size_t)sub_cnt[0][c] + sub_cnt[1][c] + sub_cnt[2][c] + sub_cnt[3][c];
+	}
+}
+
+}
+
+void histogram_scalar(const unsigned char *buf, size_t sz, size_t *cnt) {
+	SubTables sub_cnt{};
+	count_chars(buf, sz, sub_cnt);
+	merge_sub_tables(sub_cnt, cnt);
+}
+
+#ifdef HUFF_HISTOGRAM_X86
+
+void histogram_sse2(const unsigned char *buf, size_t sz, size_t *cnt) {
+	const size_t VEC_SZ = sizeof(__m128i);
+	SubTables sub_cnt{};
+
+	size_t i = 0;
+	for (; i + VEC_SZ <= sz; i += VEC_SZ) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(buf + i));
+		__m128i first = _mm_set1_epi8(buf[i]);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, first)) == 0xffff) {
+			sub_cnt[0][buf[i]] += VEC_SZ;
+		} else {
+			count_chars(buf + i, VEC_SZ, sub_cnt);
+		}
+	}
+	count_chars(buf + i, sz - i, sub_cnt);
+	merge_sub_tables(sub_cnt, cnt);
+}
+
+__attribute__((target("avx2")))
+void histogram_avx2(const unsigned char *buf, size_t sz, size_t *cnt) {
+	const size_t VEC_SZ = sizeof(__m256i);
+	SubTables sub_cnt{};
+
+	size_t i = 0;
+	for (; i + VEC_SZ <= sz; i += VEC_SZ) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)(buf + i));
+		__m256i first = _mm256_set1_epi8(buf[i]);
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, first)) == -1) {
+			sub_cnt[0][buf[i]] += VEC_SZ;
+		} else {
+			count_chars(buf + i, VEC_SZ, sub_cnt);
+		}
+	}
+	count_chars(buf + i, sz - i, sub_cnt);
+	merge_sub_tables(sub_cnt, cnt);
+}
+
+bool avx2_supported() {
+	return __builtin_cpu_supports("avx2");
+}
+
+#endif
+
+HistogramKernel get_histogram_kernel() {
+	return histogram_scalar;
+}
+
+}
\ No newline at end of file
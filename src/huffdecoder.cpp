@@ -0,0 +1,366 @@
+#include "huffdecoder.h"
+#include "huffman_util.h"
+#include <iostream>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <numeric>
+#include <bit>
+#include <utility>
+
+namespace huff_tree {
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+HuffDecoder::HuffDecoder(): table((size_t)1 << TABLE_BITS) {}
+
+HuffDecoder::~HuffDecoder() {}
+
+void HuffDecoder::rebuild(const HuffTree &htree) {
+	nodes.assign(htree.get_nodes().begin(), htree.get_nodes().end());
+	std::fill(table.begin(), table.end(), Entry());
+	expected_len = 0;
+	max_len = 1;
+	fill_table(htree.get_root(), 0, 0);
+
+	multi_table.clear();
+	if (expected_len * 2 <= MULTI_TABLE_BITS) {
+		build_multi_table();
+	}
+}
+
+bool HuffDecoder::uses_multi_table() const {
+	return !multi_table.empty();
+}
+
+void HuffDecoder::fill_table(uint16_t v, size_t code, unsigned depth) {
+	const HuffTree::Node &node = nodes[v];
+	if (node.term()) {
+		expected_len += std::ldexp((double)depth, -(int)depth);
+		max_len = std::max(max_len, depth);
+		for (size_t rest = 0; rest < ((size_t)1 << (TABLE_BITS - depth)); rest++) {
+			Entry &e = table[code | (rest << depth)];
+			e.ch = node.ch; e.len = depth;
+		}
+		return;
+	}
+	if (depth == TABLE_BITS) {
+		table[code].node = v;
+		max_len = std::max(max_len, depth + get_height(v));
+		return;
+	}
+
+	if (node.l != HuffTree::Node::NONE) {
+		fill_table(node.l, code, depth + 1);
+	}
+	if (node.r != HuffTree::Node::NONE) {
+		fill_table(node.r, code | ((size_t)1 << depth), depth + 1);
+	}
+}
+
+unsigned HuffDecoder::get_height(uint16_t v) const {
+	const HuffTree::Node &node = nodes[v];
+	unsigned result = 0;
+	for (uint16_t u : {node.l, node.r}) {
+		if (u != HuffTree::Node::NONE) {
+			result = std::max(result, get_height(u) + 1);
+		}
+	}
+	return result;
+}
+
+void HuffDecoder::build_multi_table() {
+	const size_t table_mask = ((size_t)1 << TABLE_BITS) - 1;
+	multi_table.resize((size_t)1 << MULTI_TABLE_BITS);
+
+	for (size_t idx = 0; idx < multi_table.size(); idx++) {
+		MultiEntry &me = multi_table[idx];
+		while (me.cnt < MULTI_MAX_CHARS) {
+			const Entry &e = table[(idx >> me.len) & table_mask];
+			if (e.len == 0 || me.len + e.len > MULTI_TABLE_BITS) {
+				break;
+			}
+			me.ch[me.cnt++] = e.ch;
+			me.len += e.len;
+		}
+	}
+}
+
+size_t HuffDecoder::decode(BitInputStream &bi, size_t input_sz, std::ostream &out) const {
+	const size_t buffer_sz = 1 << 16;
+	std::vector <unsigned char> buffer(buffer_sz);
+
+	size_t bits_left = input_sz, output_sz = 0;
+	while (bits_left > 0) {
+		size_t sz = decode_block(bi, bits_left, buffer.data(), buffer_sz);
+		out.write((const char*)buffer.data(), sz);
+		output_sz += sz;
+	}
+	return output_sz;
+}
+
+size_t HuffDecoder::decode(BitInputStream &bi, size_t input_sz, std::span <unsigned char> out) const {
+	size_t bits_left = input_sz;
+	size_t output_sz = decode_block(bi, bits_left, out.data(), out.size());
+	if (bits_left > 0) {
+		throw huffman::invalid_file_format("too many chars in input file");
+	}
+	return output_sz;
+}
+
+// Every char takes at most max_len bits, so as many chars as there are max_len bits in bi are decoded
+// at once, and then again on what is left of bi, until it's shorter than the longest code.
+size_t HuffDecoder::decode_partial(BitInputStream &bi, size_t &bits_left, size_t avail_bits, std::span <unsigned char> out) const {
+	if (avail_bits >= bits_left) {
+		return decode_block(bi, bits_left, out.data(), out.size());
+	}
+
+	size_t pos = 0;
+	for (size_t cnt; (cnt = std::min(out.size() - pos, avail_bits / max_len)) > 0; ) {
+		size_t bits = avail_bits;
+		pos += decode_block(bi, bits, out.data() + pos, cnt);
+		bits_left -= avail_bits - bits;
+		avail_bits = bits;
+	}
+	return pos;
+}
+
+// While every stream is far from its end, the next bits are loaded as a whole word at their bit
+// position, with no bounds checks; in a turn no stream consumes more than a table's worth of bits.
+// A stream too close to its end for another turn is finished on its own.
+void HuffDecoder::decode_interleaved(std::span <const std::span <const unsigned char>> in, std::span <const size_t> input_sz,
+                                     std::span <const std::span <unsigned char>> out) const {
+	const bool multi = uses_multi_table();
+	const unsigned turn_bits = multi ? MULTI_TABLE_BITS : TABLE_BITS;
+	const size_t word_sz = sizeof(uint64_t), word_bits = word_sz * CHAR_BIT;
+	const uint64_t table_mask = ((uint64_t)1 << TABLE_BITS) - 1, multi_mask = ((uint64_t)1 << MULTI_TABLE_BITS) - 1;
+
+	std::vector <size_t> bit_pos(in.size()), pos(in.size()), active(in.size());
+	std::iota(active.begin(), active.end(), 0);
+
+	auto load_word = [&in, &bit_pos](size_t k) {
+		const unsigned char *p = in[k].data() + bit_pos[k] / CHAR_BIT;
+		uint64_t word = 0;
+		for (size_t i = 0; i < word_sz; i++) {
+			word |= (uint64_t)p[i] << (i * CHAR_BIT);
+		}
+		return word >> (bit_pos[k] % CHAR_BIT);
+	};
+	auto get_turns = [&](size_t k) {
+		size_t bits_left = input_sz[k] - bit_pos[k];
+		size_t loadable_bits = in[k].size() * CHAR_BIT >= word_bits + bit_pos[k] ? in[k].size() * CHAR_BIT - word_bits - bit_pos[k] : 0;
+		return std::min({(out[k].size() - pos[k]) / MULTI_MAX_CHARS, bits_left / turn_bits, loadable_bits / turn_bits});
+	};
+
+	// one char or one multi entry of stream k, returns whether it was a long code
+	auto step = [&](size_t k) {
+		uint64_t word = load_word(k);
+		if (multi) {
+			const MultiEntry &me = multi_table[word & multi_mask];
+			if (me.cnt != 0) {
+				bit_pos[k] += me.len;
+				std::memcpy(out[k].data() + pos[k], me.ch, MULTI_MAX_CHARS);
+				pos[k] += me.cnt;
+				return false;
+			}
+		}
+
+		const Entry &e = table[word & table_mask];
+		if (e.len != 0) {
+			bit_pos[k] += e.len;
+			out[k][pos[k]++] = e.ch;
+			return false;
+		}
+		if (e.node == HuffTree::Node::NONE) {
+			throw huffman::invalid_file_format("invalid code in input file");
+		}
+
+		// the rest of a long code is read bit by bit, after which the turns are counted anew
+		size_t p = bit_pos[k] + TABLE_BITS;
+		const HuffTree::Node *cur = &nodes[e.node];
+		while (!cur->term() && p < input_sz[k]) {
+			bool bit = (in[k][p / CHAR_BIT] >> (p % CHAR_BIT)) & 1;
+			cur = &nodes[bit ? cur->r : cur->l];
+			p++;
+		}
+		if (!cur->term()) {
+			throw huffman::invalid_file_format("unhandled chars at the end of file");
+		}
+		bit_pos[k] = p;
+		out[k][pos[k]++] = cur->ch;
+		return true;
+	};
+
+	while (!active.empty()) {
+		size_t turns = SIZE_MAX;
+		std::erase_if(active, [&](size_t k) {
+			size_t k_turns = get_turns(k);
+			if (k_turns > 0) {
+				turns = std::min(turns, k_turns);
+				return false;
+			}
+
+			size_t bits_left = input_sz[k] - bit_pos[k];
+			if (bits_left > 0) {
+				BitInputStream bi(in[k].subspan(bit_pos[k] / CHAR_BIT));
+				bi.consume(bit_pos[k] % CHAR_BIT);
+				pos[k] += decode_block(bi, bits_left, out[k].data() + pos[k], out[k].size() - pos[k]);
+			}
+			if (bits_left > 0 || pos[k] != out[k].size()) {
+				throw huffman::invalid_file_format("wrong number of chars in archive");
+			}
+			return true;
+		});
+		if (active.empty()) {
+			break;
+		}
+
+		// with the usual number of streams their state is kept in registers
+		if (active.size() == FAST_STREAMS_CNT) {
+			const unsigned char *data[FAST_STREAMS_CNT];
+			unsigned char *dst[FAST_STREAMS_CNT];
+			size_t fast_bit_pos[FAST_STREAMS_CNT];
+			for (size_t i = 0; i < FAST_STREAMS_CNT; i++) {
+				data[i] = in[active[i]].data();
+				dst[i] = out[active[i]].data() + pos[active[i]];
+				fast_bit_pos[i] = bit_pos[active[i]];
+			}
+			size_t stalled = 0;
+			size_t done = multi ? decode_turns <FAST_STREAMS_CNT, true> (data, fast_bit_pos, dst, turns, stalled)
+			                    : decode_turns <FAST_STREAMS_CNT, false> (data, fast_bit_pos, dst, turns, stalled);
+			for (size_t i = 0; i < FAST_STREAMS_CNT; i++) {
+				pos[active[i]] = dst[i] - out[active[i]].data();
+				bit_pos[active[i]] = fast_bit_pos[i];
+			}
+			// a long code stopped a turn, which only the streams from the stalled one on still have to take
+			if (done < turns) {
+				for (size_t i = stalled; i < FAST_STREAMS_CNT; i++) {
+					step(active[i]);
+				}
+			}
+			continue;
+		}
+
+		bool long_code = false;
+		for (size_t t = 0; t < turns && !long_code; t++) {
+			for (size_t k : active) {
+				long_code |= step(k);
+			}
+		}
+	}
+}
+
+// Turns of the N streams for as long as they have no long codes, returns how many turns were done
+// completely. A turn cut short by a long code sets stalled to the stream that has it; the streams
+// before that one have already taken their turn.
+template <size_t N, bool MULTI>
+size_t HuffDecoder::decode_turns(const unsigned char **data, size_t *bit_pos, unsigned char **dst, size_t turns, size_t &stalled) const {
+	const uint64_t table_mask = ((uint64_t)1 << TABLE_BITS) - 1, multi_mask = ((uint64_t)1 << MULTI_TABLE_BITS) - 1;
+	// locals the stores of chars can't alias, so everything stays in registers
+	const Entry *single = table.data();
+	const MultiEntry *multiple = multi_table.data();
+	const unsigned char *src[N];
+	unsigned char *to[N];
+	size_t bits[N];
+	std::copy(data, data + N, src);
+	std::copy(dst, dst + N, to);
+	std::copy(bit_pos, bit_pos + N, bits);
+
+	auto step = [&](size_t k) {
+		uint64_t word = 0;
+		if constexpr (std::endian::native == std::endian::little) {
+			std::memcpy(&word, src[k] + bits[k] / CHAR_BIT, sizeof(word));
+		} else {
+			for (size_t i = 0; i < sizeof(word); i++) {
+				word |= (uint64_t)src[k][bits[k] / CHAR_BIT + i] << (i * CHAR_BIT);
+			}
+		}
+		word >>= bits[k] % CHAR_BIT;
+
+		if constexpr (MULTI) {
+			const MultiEntry &me = multiple[word & multi_mask];
+			if (me.cnt != 0) {
+				bits[k] += me.len;
+				std::memcpy(to[k], me.ch, MULTI_MAX_CHARS);
+				to[k] += me.cnt;
+				return true;
+			}
+		}
+		const Entry &e = single[word & table_mask];
+		if (e.len == 0) {
+			stalled = k;
+			return false;
+		}
+		bits[k] += e.len;
+		*to[k]++ = e.ch;
+		return true;
+	};
+	auto turn = [&step] <size_t... K> (std::index_sequence <K...>) {
+		return (step(K) && ...);
+	};
+
+	size_t t = 0;
+	while (t < turns && turn(std::make_index_sequence <N> ())) {
+		t++;
+	}
+
+	std::copy(to, to + N, dst);
+	std::copy(bits, bits + N, bit_pos);
+	return t;
+}
+
+size_t HuffDecoder::decode_block(BitInputStream &bi, size_t &bits_left, unsigned char *out, size_t out_sz) const {
+	const bool multi = uses_multi_table();
+	size_t pos = 0;
+	while (bits_left > 0 && pos < out_sz) {
+		// every bit of the window is a real one here, so the entry can't run past the declared size
+		if (multi && bits_left >= MULTI_TABLE_BITS && pos + MULTI_MAX_CHARS <= out_sz) {
+			const MultiEntry &me = multi_table[bi.peek_bits(MULTI_TABLE_BITS)];
+			if (me.cnt != 0) {
+				bi.consume(me.len);
+				bits_left -= me.len;
+
+				std::memcpy(out + pos, me.ch, MULTI_MAX_CHARS);
+				pos += me.cnt;
+				continue;
+			}
+		}
+
+		const Entry &e = table[bi.peek_bits(TABLE_BITS)];
+		unsigned char ch = e.ch;
+
+		if (e.len == 0 && e.node == HuffTree::Node::NONE) {
+			throw huffman::invalid_file_format("invalid code in input file");
+
+		} else if (e.len != 0 && e.len <= bits_left) {
+			bi.consume(e.len);
+			bits_left -= e.len;
+
+		} else if (e.node != HuffTree::Node::NONE && TABLE_BITS < bits_left) {
+			bi.consume(TABLE_BITS);
+			bits_left -= TABLE_BITS;
+
+			const HuffTree::Node *cur = &nodes[e.node];
+			while (!cur->term() && bits_left > 0) {
+				cur = &nodes[bi.read_bit() ? cur->r : cur->l];
+				bits_left--;
+			}
+			if (!cur->term()) {
+				throw huffman::invalid_file_format("unhandled chars at the end of file");
+			}
+			ch = cur->ch;
+
+		} else {
+			// the code runs past the declared size; the bits that are left must still be present
+			bi.consume(bits_left);
+			throw huffman::invalid_file_format("unhandled chars at the end of file");
+		}
+
+		out[pos++] = ch;
+	}
+	return pos;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+}
\ No newline at end of file
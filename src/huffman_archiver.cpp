@@ -1,31 +1,601 @@
 #include "huffman_archiver.h"
+#include "parallel.h"
 #include <iostream>
+#include <sstream>
+#include <cstring>
+#include <algorithm>
+#include <numeric>
+#include <stdexcept>
 
 namespace huffman {
 
 using huff_tree::CHARS_CNT;
 
 HuffFileData HuffmanArchiver::archive(std::istream &in, std::ostream &out) {
+	if (uses_blocks()) {
+		return archive_blocks(in, out);
+	}
+	if (format == ArchiveFormat::ADAPTIVE) {
+		return archive_adaptive(in, out);
+	}
+	if (format == ArchiveFormat::PERIODIC) {
+		return archive_periodic(in, out);
+	}
+	// the chars are counted on a first pass over the input and encoded on a second one
+	if (in.tellg() == std::istream::pos_type(-1)) {
+		throw std::invalid_argument("input can't be read twice, only blocks formats can be compressed from it");
+	}
+
 	CharCounter cnt;
 	count_chars(in, cnt);
-	htree.rebuild(cnt);
+	build_tree(cnt);
 
 	in.clear(); in.seekg(in.beg);
 	
 	BitOutputStream bo(out);
-	size_t additional_sz = save_tree(bo) + sizeof(size_t);
-	write_file_size(cnt, bo);
+	size_t additional_sz = write_header(cnt, bo);
 	size_t input_sz = compress_file(in, bo);
-	size_t output_sz = (calc_file_size(cnt) + CHAR_BIT - 1) / CHAR_BIT;
+	size_t output_sz = (calc_file_size(htree, cnt) + CHAR_BIT - 1) / CHAR_BIT;
 
 	return HuffFileData(input_sz, output_sz, additional_sz);
 }
 
+HuffFileData HuffmanArchiver::archive(std::span <const unsigned char> in, std::ostream &out) {
+	if (uses_blocks()) {
+		return archive_blocks(in, out);
+	}
+	if (format == ArchiveFormat::ADAPTIVE) {
+		return archive_adaptive(in, out);
+	}
+	if (format == ArchiveFormat::PERIODIC) {
+		return archive_periodic(in, out);
+	}
+
+	CharCounter cnt;
+	std::vector <CharCounter> chunks_cnt = count_chars(in, cnt);
+	build_tree(cnt);
+
+	size_t additional_sz = 0;
+	{
+		BitOutputStream bo(out);
+		additional_sz = write_header(cnt, bo);
+	}
+	compress_chunks(in, chunks_cnt, out);
+	size_t output_sz = (calc_file_size(htree, cnt) + CHAR_BIT - 1) / CHAR_BIT;
+
+	return HuffFileData(in.size(), output_sz, additional_sz);
+}
+
+HuffFileData HuffmanArchiver::archive(std::span <const unsigned char> in, const OutputProvider &get_output) {
+	if (uses_blocks()) {
+		return archive_blocks(in, get_output);
+	}
+	// the size of an adaptive code is only known once it's written, so it's written aside
+	if (format == ArchiveFormat::ADAPTIVE) {
+		std::ostringstream archive;
+		HuffFileData result = archive_adaptive(in, archive);
+		// moved out of the stream, not copied
+		const std::string code = std::move(archive).str();
+		std::span <unsigned char> out = get_output(code.size());
+		if (out.size() < code.size()) {
+			throw std::ostream::failure("no space left in output");
+		}
+		std::memcpy(out.data(), code.data(), code.size());
+		return result;
+	}
+	if (format == ArchiveFormat::PERIODIC) {
+		return archive_periodic(in, get_output);
+	}
+
+	CharCounter cnt;
+	std::vector <CharCounter> chunks_cnt = count_chars(in, cnt);
+	build_tree(cnt);
+
+	// the header is short and ends on a byte boundary, it's written aside to learn its size
+	std::stringstream header;
+	size_t additional_sz = 0;
+	{
+		BitOutputStream bo(header);
+		additional_sz = write_header(cnt, bo);
+	}
+	size_t output_sz = (calc_file_size(htree, cnt) + CHAR_BIT - 1) / CHAR_BIT;
+
+	std::span <unsigned char> out = get_output(additional_sz + output_sz);
+	std::memcpy(out.data(), header.str().data(), additional_sz);
+	compress_chunks(in, chunks_cnt, out.subspan(additional_sz));
+
+	return HuffFileData(in.size(), output_sz, additional_sz);
+}
+
+void HuffmanArchiver::set_format(ArchiveFormat fmt) {
+	format = fmt;
+}
+
+void HuffmanArchiver::set_max_code_len(size_t len) {
+	if (len > UCHAR_MAX) {
+		throw std::invalid_argument("max code length is too big");
+	}
+	max_code_len = len;
+}
+
+void HuffmanArchiver::set_block_sz(size_t sz) {
+	if (sz == 0) {
+		throw std::invalid_argument("block size must be positive");
+	}
+	block_sz = sz;
+}
+
+void HuffmanArchiver::set_window_sz(size_t sz) {
+	if (sz == 0) {
+		throw std::invalid_argument("window size must be positive");
+	}
+	window_sz = sz;
+}
+
+void HuffmanArchiver::set_streams_cnt(size_t cnt) {
+	if (cnt == 0 || cnt > UCHAR_MAX) {
+		throw std::invalid_argument("number of streams must be from 1 to 255");
+	}
+	streams_cnt = cnt;
+}
+
+void HuffmanArchiver::set_threads_cnt(size_t cnt) {
+	threads_cnt = cnt;
+}
+
+bool HuffmanArchiver::uses_blocks() const {
+	return format == ArchiveFormat::BLOCKS || format == ArchiveFormat::INTERLEAVED;
+}
+
+// Waits only for the first char of the input that hasn't arrived yet, and every whole byte
+// of the code is written and flushed before that.
+HuffFileData HuffmanArchiver::archive_adaptive(std::istream &in, std::ostream &out) const {
+	HuffFileData result;
+	AdaptiveHuffTree tree;
+	BitOutputStream bo(out);
+	result.additional_sz = save_magic(bo);
+
+	size_t bits = 0;
+	std::vector <char> buffer(BUFFER_SZ);
+	for (;;) {
+		bo.flush_bytes();
+		out.flush();
+		if (in.peek() == std::istream::traits_type::eof()) {
+			break;
+		}
+		// a stream that can't tell how much has arrived is read a char at a time
+		size_t sz = in.readsome(buffer.data(), buffer.size());
+		if (sz == 0) {
+			in.get(buffer[0]);
+			sz = 1;
+		}
+		bits += encode_adaptive(tree, std::span <const unsigned char> ((const unsigned char*)buffer.data(), sz), bo);
+		result.input_sz += sz;
+	}
+
+	bits += tree.encode(AdaptiveHuffTree::END, bo);
+	result.output_sz = (bits + CHAR_BIT - 1) / CHAR_BIT;
+	return result;
+}
+
+HuffFileData HuffmanArchiver::archive_adaptive(std::span <const unsigned char> in, std::ostream &out) const {
+	HuffFileData result;
+	AdaptiveHuffTree tree;
+	BitOutputStream bo(out);
+	result.additional_sz = save_magic(bo);
+
+	size_t bits = encode_adaptive(tree, in, bo);
+	bits += tree.encode(AdaptiveHuffTree::END, bo);
+	result.input_sz = in.size();
+	result.output_sz = (bits + CHAR_BIT - 1) / CHAR_BIT;
+	return result;
+}
+
+size_t HuffmanArchiver::encode_adaptive(AdaptiveHuffTree &tree, std::span <const unsigned char> data, BitOutputStream &bo) const {
+	size_t bits = 0;
+	for (unsigned char ch : data) {
+		bits += tree.encode(ch, bo);
+	}
+	return bits;
+}
+
+// Every window is coded with the tree of the counts of the window before it, and the first one
+// with the tree of no chars, where every char takes CHAR_BIT bits. The trees give every char
+// a code limited in length, since a char missing from a window may turn up in the next one.
+HuffFileData HuffmanArchiver::archive_periodic(std::istream &in, std::ostream &out) {
+	HuffFileData result;
+	BitOutputStream bo(out);
+	result.additional_sz = save_periodic_header(bo);
+
+	std::vector <char> buffer(window_sz);
+	for (size_t sz = 0; in.read(buffer.data(), sz = get_next_window_sz(sz)) || in.gcount() > 0; ) {
+		compress_window(std::span <const unsigned char> ((const unsigned char*)buffer.data(), in.gcount()), bo, result);
+	}
+	result.additional_sz += write_varint(0, bo);
+	return result;
+}
+
+HuffFileData HuffmanArchiver::archive_periodic(std::span <const unsigned char> in, std::ostream &out) {
+	BitOutputStream bo(out);
+	return encode_periodic(in, bo);
+}
+
+// the trees are built twice: to learn the size of the archive and to write it
+HuffFileData HuffmanArchiver::archive_periodic(std::span <const unsigned char> in, const OutputProvider &get_output) {
+	// the magic, the version, the limit of the code lengths and the window of no chars
+	HuffFileData result(in.size(), 0, ARCHIVE_MAGIC_SZ + 2 + get_varint_sz(0));
+	htree.rebuild(CharCounter(), false, get_window_code_len());
+	for (size_t i = 0, sz = 0; i < in.size(); i += sz) {
+		sz = std::min(get_next_window_sz(sz), in.size() - i);
+		std::span <const unsigned char> window = in.subspan(i, sz);
+		CharCounter cnt;
+		cnt.add_block(window.data(), window.size());
+		size_t bits = calc_file_size(htree, cnt);
+		result.output_sz += (bits + CHAR_BIT - 1) / CHAR_BIT;
+		result.additional_sz += get_varint_sz(window.size()) + get_varint_sz(bits);
+		htree.rebuild(cnt, false, get_window_code_len());
+	}
+
+	BitOutputStream bo(get_output(result.output_sz + result.additional_sz));
+	encode_periodic(in, bo);
+	bo.flush();
+	return result;
+}
+
+HuffFileData HuffmanArchiver::encode_periodic(std::span <const unsigned char> in, BitOutputStream &bo) {
+	HuffFileData result;
+	result.additional_sz = save_periodic_header(bo);
+	for (size_t i = 0, sz = 0; i < in.size(); i += sz) {
+		sz = std::min(get_next_window_sz(sz), in.size() - i);
+		compress_window(in.subspan(i, sz), bo, result);
+	}
+	result.additional_sz += write_varint(0, bo);
+	return result;
+}
+
+// the magic is followed by the limit of the code lengths, which the dearchiver needs to build the same trees
+size_t HuffmanArchiver::save_periodic_header(BitOutputStream &bo) {
+	size_t result = save_magic(bo);
+	bo.write_bits(get_window_code_len(), CHAR_BIT);
+	htree.rebuild(CharCounter(), false, get_window_code_len());
+	return result + 1;
+}
+
+void HuffmanArchiver::compress_window(std::span <const unsigned char> window, BitOutputStream &bo, HuffFileData &result) {
+	CharCounter cnt;
+	cnt.add_block(window.data(), window.size());
+	size_t bits = calc_file_size(htree, cnt);
+	result.additional_sz += write_varint(window.size(), bo);
+	result.additional_sz += write_varint(bits, bo);
+
+	compress_block(htree, window.data(), window.size(), bo);
+	bo.write_bits(0, (CHAR_BIT - bits % CHAR_BIT) % CHAR_BIT);
+	result.input_sz += window.size();
+	result.output_sz += (bits + CHAR_BIT - 1) / CHAR_BIT;
+
+	htree.rebuild(cnt, false, get_window_code_len());
+}
+
+// the first window is coded with no counts at all, so the windows grow up to window_sz from a small one
+size_t HuffmanArchiver::get_next_window_sz(size_t sz) const {
+	return std::min(window_sz, sz == 0 ? FIRST_WINDOW_SZ : sz * 2);
+}
+
+size_t HuffmanArchiver::get_window_code_len() const {
+	return max_code_len != 0 ? max_code_len : DEFAULT_WINDOW_CODE_LEN;
+}
+
+HuffFileData HuffmanArchiver::archive_blocks(std::istream &in, std::ostream &out) const {
+	HuffFileData result;
+	{
+		BitOutputStream bo(out);
+		result.additional_sz = save_magic(bo);
+	}
+
+	std::vector <BlockIndexEntry> index;
+	std::vector <char> buffer(get_batch_sz());
+	while (in.read(buffer.data(), buffer.size()) || in.gcount() > 0) {
+		size_t sz = in.gcount();
+		result.input_sz += sz;
+		compress_blocks(std::span <const unsigned char> ((const unsigned char*)buffer.data(), sz), out, index, result);
+	}
+
+	BitOutputStream bo(out);
+	result.additional_sz += save_blocks_end(index, bo);
+	return result;
+}
+
+HuffFileData HuffmanArchiver::archive_blocks(std::span <const unsigned char> in, std::ostream &out) const {
+	HuffFileData result;
+	result.input_sz = in.size();
+	{
+		BitOutputStream bo(out);
+		result.additional_sz = save_magic(bo);
+	}
+
+	std::vector <BlockIndexEntry> index;
+	const size_t batch_sz = get_batch_sz();
+	for (size_t pos = 0; pos < in.size(); pos += batch_sz) {
+		compress_blocks(in.subspan(pos, std::min(batch_sz, in.size() - pos)), out, index, result);
+	}
+
+	BitOutputStream bo(out);
+	result.additional_sz += save_blocks_end(index, bo);
+	return result;
+}
+
+HuffFileData HuffmanArchiver::archive_blocks(std::span <const unsigned char> in, const OutputProvider &get_output) const {
+	HuffFileData result;
+	result.input_sz = in.size();
+	result.additional_sz = ARCHIVE_MAGIC_SZ + 1;
+
+	std::vector <BlockPlan> plans;
+	std::vector <BlockIndexEntry> index;
+	std::vector <size_t> offsets = plan_blocks(in, plans, index, result);
+
+	std::stringstream end;
+	{
+		BitOutputStream bo(end);
+		result.additional_sz += save_blocks_end(index, bo);
+	}
+
+	std::span <unsigned char> out = get_output(result.output_sz + result.additional_sz);
+	{
+		BitOutputStream bo(out.first(ARCHIVE_MAGIC_SZ + 1));
+		save_magic(bo);
+		bo.flush();
+	}
+	encode_blocks(in, plans, offsets, out.subspan(ARCHIVE_MAGIC_SZ + 1, offsets.back()));
+	std::string end_str = end.str();
+	std::memcpy(out.data() + ARCHIVE_MAGIC_SZ + 1 + offsets.back(), end_str.data(), end_str.size());
+	return result;
+}
+
+void HuffmanArchiver::compress_blocks(std::span <const unsigned char> data, std::ostream &out, std::vector <BlockIndexEntry> &index, HuffFileData &result) const {
+	std::vector <BlockPlan> plans;
+	std::vector <size_t> offsets = plan_blocks(data, plans, index, result);
+
+	std::vector <unsigned char> buffer(offsets.back());
+	encode_blocks(data, plans, offsets, buffer);
+	out.write((const char*)buffer.data(), buffer.size());
+}
+
+std::vector <size_t> HuffmanArchiver::plan_blocks(std::span <const unsigned char> data, std::vector <BlockPlan> &plans, std::vector <BlockIndexEntry> &index, HuffFileData &result) const {
+	const size_t blocks_cnt = (data.size() + block_sz - 1) / block_sz;
+	plans.assign(blocks_cnt, BlockPlan());
+	parallel::parallel_for(blocks_cnt, threads_cnt, [&](size_t i) {
+		plan_block(get_block(data, i), plans[i]);
+	});
+
+	std::vector <size_t> offsets(blocks_cnt + 1);
+	for (size_t i = 0; i < blocks_cnt; i++) {
+		offsets[i + 1] = offsets[i] + plans[i].header.size() + plans[i].payload_sz;
+		result.additional_sz += plans[i].header.size();
+		result.output_sz += plans[i].payload_sz;
+		index.push_back({offsets[i + 1] - offsets[i], get_block(data, i).size()});
+	}
+	return offsets;
+}
+
+// A block is its number of chars, its code lengths, the size of its payload in bits
+// and the payload padded to a byte. In the interleaved format the block is coded as
+// several streams instead: their number and their sizes in bits go before them.
+void HuffmanArchiver::plan_block(std::span <const unsigned char> block, BlockPlan &plan) const {
+	const size_t block_streams_cnt = get_block_streams_cnt();
+	std::vector <CharCounter> segments_cnt(block_streams_cnt);
+	CharCounter cnt;
+	for (size_t i = 0; i < block_streams_cnt; i++) {
+		std::span <const unsigned char> segment = get_segment(block, i);
+		segments_cnt[i].add_block(segment.data(), segment.size());
+		cnt.merge(segments_cnt[i]);
+	}
+
+	HuffTree tree;
+	tree.rebuild(cnt, true, max_code_len);
+	plan.code_len = tree.get_code_lengths();
+	tree.rebuild_canonical(plan.code_len);
+
+	std::stringstream header;
+	{
+		BitOutputStream bo(header);
+		write_varint(block.size(), bo);
+		save_code_lengths(tree, bo);
+		if (format == ArchiveFormat::INTERLEAVED) {
+			bo.write_bits(block_streams_cnt, CHAR_BIT);
+		}
+		for (const CharCounter &segment_cnt : segments_cnt) {
+			size_t stream_bits = calc_file_size(tree, segment_cnt);
+			write_varint(stream_bits, bo);
+			plan.streams_sz.push_back((stream_bits + CHAR_BIT - 1) / CHAR_BIT);
+			plan.payload_sz += plan.streams_sz.back();
+		}
+	}
+	plan.header = header.str();
+
+	// a block that doesn't compress is copied instead, both when written and when read
+	if (plan.header.size() + plan.payload_sz >= get_varint_sz(block.size()) + 1 + block.size()) {
+		plan_stored_block(block, plan);
+	}
+}
+
+void HuffmanArchiver::plan_stored_block(std::span <const unsigned char> block, BlockPlan &plan) const {
+	plan = BlockPlan();
+	plan.stored = true;
+	plan.payload_sz = block.size();
+
+	std::stringstream header;
+	{
+		BitOutputStream bo(header);
+		write_varint(block.size(), bo);
+		bo.write_bits(BLOCK_STORED, CHAR_BIT);
+	}
+	plan.header = header.str();
+}
+
+void HuffmanArchiver::encode_blocks(std::span <const unsigned char> data, const std::vector <BlockPlan> &plans, const std::vector <size_t> &offsets, std::span <unsigned char> out) const {
+	parallel::parallel_for(plans.size(), threads_cnt, [&](size_t i) {
+		const BlockPlan &plan = plans[i];
+		std::span <unsigned char> block_out = out.subspan(offsets[i], offsets[i + 1] - offsets[i]);
+		std::memcpy(block_out.data(), plan.header.data(), plan.header.size());
+
+		std::span <const unsigned char> block = get_block(data, i);
+		if (plan.stored) {
+			std::memcpy(block_out.data() + plan.header.size(), block.data(), block.size());
+			return;
+		}
+
+		HuffTree tree;
+		tree.rebuild_canonical(plan.code_len);
+		size_t pos = plan.header.size();
+		for (size_t j = 0; j < plan.streams_sz.size(); j++) {
+			BitOutputStream bo(block_out.subspan(pos, plan.streams_sz[j]));
+			std::span <const unsigned char> segment = get_segment(block, j);
+			compress_block(tree, segment.data(), segment.size(), bo);
+			bo.flush();
+			pos += plan.streams_sz[j];
+		}
+	});
+}
+
+std::span <const unsigned char> HuffmanArchiver::get_block(std::span <const unsigned char> data, size_t i) const {
+	return data.subspan(i * block_sz, std::min(block_sz, data.size() - i * block_sz));
+}
+
+size_t HuffmanArchiver::get_block_streams_cnt() const {
+	return format == ArchiveFormat::INTERLEAVED ? streams_cnt : 1;
+}
+
+std::span <const unsigned char> HuffmanArchiver::get_segment(std::span <const unsigned char> block, size_t i) const {
+	const size_t segment_sz = get_segment_sz(block.size(), get_block_streams_cnt());
+	const size_t begin = std::min(i * segment_sz, block.size());
+	return block.subspan(begin, std::min(segment_sz, block.size() - begin));
+}
+
+size_t HuffmanArchiver::get_batch_sz() const {
+	return block_sz * std::min(parallel::get_threads_cnt(threads_cnt) * BATCH_BLOCKS_PER_THREAD, MAX_BATCH_BLOCKS);
+}
+
+void HuffmanArchiver::build_tree(const CharCounter &cnt) {
+	if (format == ArchiveFormat::LEGACY) {
+		htree.rebuild(cnt, false, max_code_len);
+	} else {
+		htree.rebuild(cnt, true, max_code_len);
+		htree.rebuild_canonical(htree.get_code_lengths());
+	}
+}
+
+size_t HuffmanArchiver::write_header(const CharCounter &cnt, BitOutputStream &bo) const {
+	if (format == ArchiveFormat::LEGACY) {
+		size_t result = save_tree(bo) + sizeof(size_t);
+		write_file_size(cnt, bo);
+		return result;
+	}
+	return save_header(cnt, bo);
+}
+
 void HuffmanArchiver::count_chars(std::istream &in, CharCounter &cnt) const {
-	char buf;
-	while (in.read(&buf, 1)) {
-		cnt.add_char(buf);
+	std::vector <char> buffer(BUFFER_SZ);
+	while (in.read(buffer.data(), BUFFER_SZ) || in.gcount() > 0) {
+		cnt.add_block((const unsigned char*)buffer.data(), in.gcount());
+	}
+}
+
+// Every chunk is counted on its own, then the counts are summed.
+std::vector <CharCounter> HuffmanArchiver::count_chars(std::span <const unsigned char> in, CharCounter &cnt) const {
+	std::vector <CharCounter> chunks_cnt(std::max((in.size() + CHUNK_SZ - 1) / CHUNK_SZ, (size_t)1));
+	parallel::parallel_for(chunks_cnt.size(), threads_cnt, [&](size_t i) {
+		std::span <const unsigned char> chunk = get_chunk(in, i);
+		chunks_cnt[i].add_block(chunk.data(), chunk.size());
+	});
+	for (const CharCounter &chunk_cnt : chunks_cnt) {
+		cnt.merge(chunk_cnt);
+	}
+	return chunks_cnt;
+}
+
+// The chunks are encoded in batches; the last byte of a batch is carried over to the next one
+// unless the batch ends on a byte boundary.
+void HuffmanArchiver::compress_chunks(std::span <const unsigned char> in, const std::vector <CharCounter> &chunks_cnt, std::ostream &out) const {
+	std::vector <size_t> offsets = get_chunk_offsets(chunks_cnt);
+	const size_t batch_chunks = parallel::get_threads_cnt(threads_cnt) * BATCH_BLOCKS_PER_THREAD;
+
+	std::vector <unsigned char> buffer;
+	unsigned char carry = 0;
+	for (size_t first = 0; first < chunks_cnt.size(); first += batch_chunks) {
+		size_t last = std::min(first + batch_chunks, chunks_cnt.size());
+		size_t begin = offsets[first] / CHAR_BIT, end = offsets[last] / CHAR_BIT;
+		buffer.resize((offsets[last] + CHAR_BIT - 1) / CHAR_BIT - begin);
+		encode_chunks(in, offsets, first, last, buffer);
+		if (buffer.empty()) {
+			continue;
+		}
+		buffer[0] |= carry;
+		out.write((const char*)buffer.data(), end - begin);
+		carry = end - begin < buffer.size() ? buffer.back() : 0;
+	}
+	if (offsets.back() % CHAR_BIT != 0) {
+		out.put(carry);
+	}
+}
+
+void HuffmanArchiver::compress_chunks(std::span <const unsigned char> in, const std::vector <CharCounter> &chunks_cnt, std::span <unsigned char> out) const {
+	std::vector <size_t> offsets = get_chunk_offsets(chunks_cnt);
+	encode_chunks(in, offsets, 0, chunks_cnt.size(), out.first((offsets.back() + CHAR_BIT - 1) / CHAR_BIT));
+}
+
+std::vector <size_t> HuffmanArchiver::get_chunk_offsets(const std::vector <CharCounter> &chunks_cnt) const {
+	std::vector <size_t> offsets(chunks_cnt.size() + 1);
+	for (size_t i = 0; i < chunks_cnt.size(); i++) {
+		offsets[i + 1] = offsets[i] + calc_file_size(htree, chunks_cnt[i]);
 	}
+	return offsets;
+}
+
+// Every chunk is encoded aside, shifted to where it starts in its first byte, and its whole bytes
+// are copied to out. A byte shared by two chunks is put together from both of them afterwards.
+void HuffmanArchiver::encode_chunks(std::span <const unsigned char> in, const std::vector <size_t> &offsets, size_t first, size_t last,
+                                    std::span <unsigned char> out) const {
+	const size_t base = offsets[first] / CHAR_BIT;
+	std::vector <unsigned char> head(last - first), tail(last - first);
+	parallel::parallel_for(last - first, threads_cnt, [&](size_t i) {
+		size_t begin = offsets[first + i], end = offsets[first + i + 1];
+		std::vector <unsigned char> buffer((end + CHAR_BIT - 1) / CHAR_BIT - begin / CHAR_BIT);
+		{
+			BitOutputStream bo(buffer);
+			bo.write_bits(0, begin % CHAR_BIT);
+			std::span <const unsigned char> chunk = get_chunk(in, first + i);
+			compress_block(htree, chunk.data(), chunk.size(), bo);
+			bo.flush();
+		}
+		if (buffer.empty()) {
+			return;
+		}
+
+		size_t whole_begin = (begin + CHAR_BIT - 1) / CHAR_BIT, whole_end = end / CHAR_BIT;
+		if (whole_begin < whole_end) {
+			std::memcpy(out.data() + whole_begin - base, buffer.data() + whole_begin - begin / CHAR_BIT, whole_end - whole_begin);
+		}
+		head[i] = buffer.front();
+		tail[i] = buffer.back();
+	});
+
+	for (size_t i = first; i <= last; i++) {
+		if (offsets[i] % CHAR_BIT != 0) {
+			out[offsets[i] / CHAR_BIT - base] = 0;
+		}
+	}
+	for (size_t i = 0; i < last - first; i++) {
+		if (offsets[first + i] % CHAR_BIT != 0) {
+			out[offsets[first + i] / CHAR_BIT - base] |= head[i];
+		}
+		if (offsets[first + i + 1] % CHAR_BIT != 0) {
+			out[offsets[first + i + 1] / CHAR_BIT - base] |= tail[i];
+		}
+	}
+}
+
+std::span <const unsigned char> HuffmanArchiver::get_chunk(std::span <const unsigned char> in, size_t i) const {
+	return in.subspan(i * CHUNK_SZ, std::min(CHUNK_SZ, in.size() - i * CHUNK_SZ));
 }
 
 size_t HuffmanArchiver::save_tree(BitOutputStream &bo) const {
@@ -44,32 +614,150 @@ size_t HuffmanArchiver::save_tree(BitOutputStream &bo) const {
 }
 
 size_t HuffmanArchiver::compress_file(std::istream &in, BitOutputStream &bo) const {
-	char buf;
+	std::vector <char> buffer(BUFFER_SZ);
+
 	size_t file_sz = 0;
-	while (in.read(&buf, 1)) {
-		file_sz++;
-		
-		const std::vector <bool> &code = htree.get_char_code((unsigned char)buf);
-		for (bool b : code) {
+	while (in.read(buffer.data(), BUFFER_SZ) || in.gcount() > 0) {
+		size_t sz = in.gcount();
+		file_sz += sz;
+		compress_block(htree, (const unsigned char*)buffer.data(), sz, bo);
+	}
+	return file_sz;
+}
+
+void HuffmanArchiver::compress_block(const HuffTree &tree, const unsigned char *buf, size_t sz, BitOutputStream &bo) const {
+	const PackedCode *codes = tree.get_packed_codes();
+	for (size_t i = 0; i < sz; i++) {
+		const PackedCode &pc = codes[buf[i]];
+		if (pc.len <= PackedCode::MAX_LEN) {
+			bo.write_bits(pc.code, pc.len);
+			continue;
+		}
+		for (bool b : tree.get_char_code(buf[i])) {
 			bo.write_bit(b);
 		}
 	}
-	return file_sz;
 }
 
-size_t HuffmanArchiver::calc_file_size(const CharCounter &cnt) const {
+size_t HuffmanArchiver::calc_file_size(const HuffTree &tree, const CharCounter &cnt) const {
 	size_t result = 0;
 	for (size_t i = 0; i < CHARS_CNT; i++) {
-		result += cnt.get_char_cnt(i) * htree.get_char_code(i).size();
+		result += cnt.get_char_cnt(i) * tree.get_char_code(i).size();
 	}
 	return result;
 }
 
 void HuffmanArchiver::write_file_size(const CharCounter &cnt, BitOutputStream &bo) const {
-	size_t sz = calc_file_size(cnt);
-	for (size_t i = 0; i < sizeof(sz) * CHAR_BIT; i++) {
-		bo.write_bit(sz & ((size_t)1 << i));
+	size_t sz = calc_file_size(htree, cnt);
+	bo.write_bits(sz, sizeof(sz) * CHAR_BIT);
+}
+
+size_t HuffmanArchiver::save_magic(BitOutputStream &bo) const {
+	for (char c : ARCHIVE_MAGIC) {
+		bo.write_bits((unsigned char)c, CHAR_BIT);
 	}
+	bo.write_bits((unsigned char)format, CHAR_BIT);
+	return ARCHIVE_MAGIC_SZ + 1;
+}
+
+size_t HuffmanArchiver::save_header(const CharCounter &cnt, BitOutputStream &bo) const {
+	size_t result = save_magic(bo);
+	result += save_code_lengths(htree, bo);
+	result += write_varint(calc_file_size(htree, cnt), bo);
+	result += write_varint(cnt.get_total_cnt(), bo);
+	return result;
+}
+
+size_t HuffmanArchiver::save_code_lengths(const HuffTree &tree, BitOutputStream &bo) const {
+	const unsigned nibble_bits = CHAR_BIT / 2;
+	std::vector <unsigned char> code_len = tree.get_code_lengths();
+
+	std::vector <unsigned char> chars;
+	for (size_t i = 0; i < CHARS_CNT; i++) {
+		if (code_len[i] > 0) {
+			chars.push_back(i);
+		}
+	}
+
+	unsigned char flags = 0;
+	if (*std::max_element(code_len.begin(), code_len.end()) < (1 << nibble_bits)) {
+		flags |= CANONICAL_NIBBLE_LENGTHS;
+	}
+	const unsigned len_bits = (flags & CANONICAL_NIBBLE_LENGTHS) ? nibble_bits : CHAR_BIT;
+
+	size_t lengths_sz = (chars.size() * len_bits + CHAR_BIT - 1) / CHAR_BIT;
+	size_t full_sz = CHARS_CNT * len_bits / CHAR_BIT;
+	size_t list_sz = 1 + chars.size() + lengths_sz;
+	size_t bitmap_sz = CHARS_CNT / CHAR_BIT + lengths_sz;
+
+	size_t result = full_sz;
+	if (chars.size() < CHARS_CNT && list_sz <= std::min(bitmap_sz, full_sz)) {
+		flags |= CANONICAL_CHAR_LIST;
+		result = list_sz;
+	} else if (bitmap_sz < full_sz) {
+		flags |= CANONICAL_CHAR_BITMAP;
+		result = bitmap_sz;
+	}
+	bo.write_bits(flags, CHAR_BIT);
+
+	if (flags & CANONICAL_CHAR_LIST) {
+		bo.write_bits(chars.size(), CHAR_BIT);
+		for (unsigned char c : chars) {
+			bo.write_bits(c, CHAR_BIT);
+		}
+	} else if (flags & CANONICAL_CHAR_BITMAP) {
+		for (size_t i = 0; i < CHARS_CNT; i++) {
+			bo.write_bit(code_len[i] > 0);
+		}
+	} else {
+		chars.resize(CHARS_CNT);
+		std::iota(chars.begin(), chars.end(), 0);
+	}
+
+	for (unsigned char c : chars) {
+		bo.write_bits(code_len[c], len_bits);
+	}
+	bo.write_bits(0, (CHAR_BIT - chars.size() * len_bits % CHAR_BIT) % CHAR_BIT);
+
+	return 1 + result;
+}
+
+// A block of no chars ends the blocks, then goes their index.
+size_t HuffmanArchiver::save_blocks_end(const std::vector <BlockIndexEntry> &index, BitOutputStream &bo) const {
+	size_t result = write_varint(0, bo);
+	size_t index_sz = write_varint(index.size(), bo);
+	for (const BlockIndexEntry &entry : index) {
+		index_sz += write_varint(entry.archive_sz, bo);
+		index_sz += write_varint(entry.chars_cnt, bo);
+	}
+	bo.write_bits(index_sz, BLOCKS_INDEX_SIZE_BYTES * CHAR_BIT);
+	for (char c : ARCHIVE_MAGIC) {
+		bo.write_bits((unsigned char)c, CHAR_BIT);
+	}
+	return result + index_sz + BLOCKS_INDEX_SIZE_BYTES + ARCHIVE_MAGIC_SZ;
+}
+
+size_t HuffmanArchiver::write_varint(size_t x, BitOutputStream &bo) const {
+	const unsigned group_bits = CHAR_BIT - 1;
+	size_t result = 0;
+	do {
+		unsigned char group = x & ((1 << group_bits) - 1);
+		x >>= group_bits;
+		if (x != 0) {
+			group |= 1 << group_bits;
+		}
+		bo.write_bits(group, CHAR_BIT);
+		result++;
+	} while (x != 0);
+	return result;
+}
+
+size_t HuffmanArchiver::get_varint_sz(size_t x) const {
+	size_t result = 1;
+	while (x >>= CHAR_BIT - 1) {
+		result++;
+	}
+	return result;
 }
 
 }
\ No newline at end of file
@@ -0,0 +1,50 @@
+#include "huffman_buffer.h"
+#include "huffman_archiver.h"
+#include "huffman_dearchiver.h"
+#include <algorithm>
+
+namespace huffman {
+
+using huff_tree::CHARS_CNT;
+
+static std::span <const unsigned char> as_chars(std::span <const std::byte> data) {
+	return std::span <const unsigned char> ((const unsigned char*)data.data(), data.size());
+}
+
+size_t compress_bound(size_t n) {
+	// the char permutation, the tree tour padded to bytes and the payload size
+	const size_t legacy_header_sz = CHARS_CNT + ((CHARS_CNT * 2 - 2) * 2 + CHAR_BIT - 1) / CHAR_BIT + sizeof(size_t);
+	// the magic, the version, the flags, at most a byte per code length and two varints of 10 bytes
+	const size_t max_varint_sz = (sizeof(size_t) * CHAR_BIT + CHAR_BIT - 2) / (CHAR_BIT - 1);
+	const size_t canonical_header_sz = ARCHIVE_MAGIC_SZ + 1 + 1 + CHARS_CNT + max_varint_sz * 2;
+	// blocks formats store the blocks that don't compress: every block takes at most its chars, their
+	// number and a flag, then go the block of no chars and the index of the number of blocks and two
+	// varints per block, its size and the magic
+	const size_t blocks_cnt = (n + HuffmanArchiver::DEFAULT_BLOCK_SZ - 1) / HuffmanArchiver::DEFAULT_BLOCK_SZ;
+	const size_t blocks_overhead_sz = ARCHIVE_MAGIC_SZ + 1 + blocks_cnt * (max_varint_sz + 1) + 1
+	                                  + max_varint_sz * (1 + blocks_cnt * 2) + BLOCKS_INDEX_SIZE_BYTES + ARCHIVE_MAGIC_SZ;
+	// an optimal code (limited or not) is never worse than the code of CHAR_BIT bits for every char
+	return std::max({legacy_header_sz, canonical_header_sz, blocks_overhead_sz}) + n;
+}
+
+HuffFileData compress(std::span <const std::byte> in, std::vector <std::byte> &out, ArchiveFormat format, size_t max_code_len) {
+	HuffmanArchiver a;
+	a.set_format(format);
+	a.set_max_code_len(max_code_len);
+	return a.archive(as_chars(in), [&out](size_t sz) {
+		out.resize(sz);
+		return std::span <unsigned char> ((unsigned char*)out.data(), sz);
+	});
+}
+
+HuffFileData decompress(std::span <const std::byte> in, std::vector <std::byte> &out) {
+	HuffmanDearchiver d;
+	HuffFileData result = d.dearchive(as_chars(in), [&out](size_t sz) {
+		out.resize(sz);
+		return std::span <unsigned char> ((unsigned char*)out.data(), sz);
+	});
+	out.resize(result.output_sz);
+	return result;
+}
+
+}
\ No newline at end of file
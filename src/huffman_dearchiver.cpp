@@ -1,32 +1,557 @@
 #include "huffman_dearchiver.h"
+#include "parallel.h"
 #include <iostream>
+#include <cstring>
+#include <type_traits>
+#include <algorithm>
+#include <numeric>
+#include <stdexcept>
 
 namespace huffman {
 
 using huff_tree::CHARS_CNT;
 
 HuffFileData HuffmanDearchiver::dearchive(std::istream &in, std::ostream &out) {
-	std::vector <unsigned char> ch_perm = get_char_permutation_from_archive(in);
+	if (in.peek() == std::istream::traits_type::eof()) {
+		throw invalid_file_format("error while reading char permutation");
+	}
 	BitInputStream bi(in);
+	return dearchive(bi, out);
+}
+
+HuffFileData HuffmanDearchiver::dearchive(std::span <const unsigned char> in, std::ostream &out) {
+	if (in.empty()) {
+		throw invalid_file_format("error while reading char permutation");
+	}
+	if (is_blocks_archive(in)) {
+		return dearchive_blocks(in.subspan(ARCHIVE_MAGIC_SZ + 1), (ArchiveFormat)in[ARCHIVE_MAGIC_SZ], out);
+	}
+	BitInputStream bi(in);
+	return dearchive(bi, out);
+}
+
+HuffFileData HuffmanDearchiver::dearchive(std::span <const unsigned char> in, const OutputProvider &get_output) {
+	if (in.empty()) {
+		throw invalid_file_format("error while reading char permutation");
+	}
+	if (is_blocks_archive(in)) {
+		return dearchive_blocks(in.subspan(ARCHIVE_MAGIC_SZ + 1), (ArchiveFormat)in[ARCHIVE_MAGIC_SZ], get_output);
+	}
+	BitInputStream bi(in);
+	return dearchive(bi, get_output);
+}
+
+void HuffmanDearchiver::set_threads_cnt(size_t cnt) {
+	threads_cnt = cnt;
+}
+
+template <class Output>
+HuffFileData HuffmanDearchiver::dearchive(BitInputStream &bi, Output &out) {
+	const unsigned magic_bits = ARCHIVE_MAGIC_SZ * CHAR_BIT;
+	uint64_t magic = 0;
+	for (size_t i = 0; i < ARCHIVE_MAGIC_SZ; i++) {
+		magic |= (uint64_t)(unsigned char)ARCHIVE_MAGIC[i] << (i * CHAR_BIT);
+	}
+	// a shorter input is zero-padded, and the magic has no zero bytes
+	if (bi.peek_bits(magic_bits) != magic) {
+		return dearchive_legacy(bi, out);
+	}
+	bi.consume(magic_bits);
+
+	try {
+		ArchiveFormat format = (ArchiveFormat)bi.read_bits(CHAR_BIT);
+		HuffFileData result;
+		if (format == ArchiveFormat::CANONICAL) {
+			result = dearchive_canonical(bi, out);
+		} else if (format == ArchiveFormat::ADAPTIVE) {
+			result = dearchive_adaptive(bi, out);
+		} else if (format == ArchiveFormat::PERIODIC) {
+			result = dearchive_periodic(bi, out);
+		} else if (format != ArchiveFormat::BLOCKS && format != ArchiveFormat::INTERLEAVED) {
+			throw invalid_file_format("unknown archive format version");
+		} else if constexpr (std::is_same_v <Output, std::ostream>) {
+			result = dearchive_blocks(bi, format, out);
+		} else {
+			// blocks archives decoded to memory are handled on the span instead
+			throw std::logic_error("blocks archive isn't decoded to memory from a stream");
+		}
+		result.additional_sz += ARCHIVE_MAGIC_SZ + 1;
+		return result;
+
+	} catch (std::istream::failure &e) {
+		throw invalid_file_format("error while reading archive header");
+	}
+}
+
+template <class Output>
+HuffFileData HuffmanDearchiver::dearchive_legacy(BitInputStream &bi, Output &out) {
+	std::vector <unsigned char> ch_perm = get_char_permutation_from_archive(bi);
 	std::vector <bool> tree = get_tree_tour(bi);
 	htree.rebuild(ch_perm, tree);
+	decoder.rebuild(htree);
 
 	size_t additional_sz = ch_perm.size() + (tree.size() + CHAR_BIT - 1) / CHAR_BIT + sizeof(size_t);
 	size_t input_sz_bits = read_file_size(bi);
 	size_t input_sz = (input_sz_bits + CHAR_BIT - 1) / CHAR_BIT;
-	size_t output_sz = decompress_file(bi, input_sz_bits, out);
+	size_t output_sz = decompress_file(bi, input_sz_bits, get_max_chars_cnt(htree, input_sz_bits), out);
 
 	return HuffFileData(input_sz, output_sz, additional_sz);
 }
 
-std::vector <unsigned char> HuffmanDearchiver::get_char_permutation_from_archive(std::istream &in) const {
-	char buf;
-	std::vector <unsigned char> result;
-	for (size_t i = 0; i < CHARS_CNT; i++) {
-		if (!in.read(&buf, 1)) {
-			throw invalid_file_format("error while reading char permutation");
+template <class Output>
+HuffFileData HuffmanDearchiver::dearchive_canonical(BitInputStream &bi, Output &out) {
+	std::vector <unsigned char> code_len;
+	size_t additional_sz = read_code_lengths(bi, code_len);
+	htree.rebuild_canonical(code_len);
+	decoder.rebuild(htree);
+
+	size_t input_sz_bits, chars_cnt;
+	additional_sz += read_varint(bi, input_sz_bits);
+	additional_sz += read_varint(bi, chars_cnt);
+
+	if (chars_cnt > get_max_chars_cnt(htree, input_sz_bits)) {
+		throw invalid_file_format("wrong number of chars in archive");
+	}
+
+	size_t input_sz = (input_sz_bits + CHAR_BIT - 1) / CHAR_BIT;
+	size_t output_sz = decompress_file(bi, input_sz_bits, chars_cnt, out);
+	if (output_sz != chars_cnt) {
+		throw invalid_file_format("wrong number of chars in archive");
+	}
+
+	return HuffFileData(input_sz, output_sz, additional_sz);
+}
+
+HuffFileData HuffmanDearchiver::dearchive_adaptive(BitInputStream &bi, std::ostream &out) const {
+	AdaptiveHuffTree tree;
+	HuffFileData result;
+	std::vector <unsigned char> buffer(BUFFER_SZ);
+	size_t bits = 0, len = 0, pos = 0;
+	try {
+		for (size_t symbol; (symbol = tree.decode(bi, len)) != AdaptiveHuffTree::END; bits += len) {
+			buffer[pos++] = symbol;
+			if (pos == buffer.size()) {
+				out.write((const char*)buffer.data(), pos);
+				result.output_sz += pos;
+				pos = 0;
+			}
+		}
+	} catch (std::istream::failure &e) {
+		throw invalid_file_format("too few bits in input file");
+	}
+	out.write((const char*)buffer.data(), pos);
+
+	result.output_sz += pos;
+	result.input_sz = (bits + len + CHAR_BIT - 1) / CHAR_BIT;
+	return result;
+}
+
+// the number of chars is only known once they're decoded, so they're decoded aside
+// and the memory is asked for once they're all there
+HuffFileData HuffmanDearchiver::dearchive_adaptive(BitInputStream &bi, const OutputProvider &get_output) const {
+	AdaptiveHuffTree tree;
+	HuffFileData result;
+	std::vector <unsigned char> chars;
+	size_t bits = 0, len = 0;
+	try {
+		for (size_t symbol; (symbol = tree.decode(bi, len)) != AdaptiveHuffTree::END; bits += len) {
+			chars.push_back(symbol);
+		}
+	} catch (std::istream::failure &e) {
+		throw invalid_file_format("too few bits in input file");
+	}
+
+	std::memcpy(get_output(chars.size()).data(), chars.data(), chars.size());
+	result.output_sz = chars.size();
+	result.input_sz = (bits + len + CHAR_BIT - 1) / CHAR_BIT;
+	return result;
+}
+
+template <class Output>
+HuffFileData HuffmanDearchiver::dearchive_periodic(BitInputStream &bi, Output &out) {
+	const size_t code_len = read_window_code_len(bi);
+	HuffFileData result(0, 0, 1);
+	// a stream gets the chars a buffer at a time, memory gets them all in place
+	std::vector <unsigned char> buffer;
+	std::span <unsigned char> memory;
+	if constexpr (std::is_same_v <Output, std::ostream>) {
+		buffer.resize(BUFFER_SZ);
+	} else {
+		memory = out(count_window_chars(bi));
+	}
+
+	CharCounter cnt;
+	htree.rebuild(cnt, false, code_len);
+	for (;;) {
+		size_t chars_cnt, bits;
+		result.additional_sz += read_varint(bi, chars_cnt);
+		if (chars_cnt == 0) {
+			break;
+		}
+		result.additional_sz += read_varint(bi, bits);
+		decoder.rebuild(htree);
+		if (chars_cnt > get_max_chars_cnt(htree, bits)) {
+			throw invalid_file_format("wrong number of chars in archive");
+		}
+
+		cnt = CharCounter();
+		size_t chars_left = chars_cnt;
+		try {
+			if constexpr (std::is_same_v <Output, std::ostream>) {
+				for (size_t bits_left = bits; bits_left > 0; ) {
+					size_t sz = decoder.decode_partial(bi, bits_left, bits_left, std::span(buffer).first(std::min(buffer.size(), chars_left)));
+					if (sz == 0) {
+						throw invalid_file_format("wrong number of chars in archive");
+					}
+					cnt.add_block(buffer.data(), sz);
+					out.write((const char*)buffer.data(), sz);
+					chars_left -= sz;
+				}
+			} else {
+				if (bits > bi.bits_remaining()) {
+					throw invalid_file_format("too few bits in input file");
+				}
+				std::span <unsigned char> window = memory.subspan(result.output_sz, chars_cnt);
+				chars_left -= decoder.decode(bi, bits, window);
+				cnt.add_block(window.data(), window.size());
+			}
+			bi.consume((CHAR_BIT - bits % CHAR_BIT) % CHAR_BIT);
+		} catch (std::istream::failure &e) {
+			throw invalid_file_format("too few bits in input file");
+		}
+		if (chars_left != 0) {
+			throw invalid_file_format("wrong number of chars in archive");
+		}
+
+		result.input_sz += (bits + CHAR_BIT - 1) / CHAR_BIT;
+		result.output_sz += chars_cnt;
+		htree.rebuild(cnt, false, code_len);
+	}
+	return result;
+}
+
+// the trees of a periodic archive have every char, so the limit can't be shorter than CHAR_BIT
+size_t HuffmanDearchiver::read_window_code_len(BitInputStream &bi) const {
+	size_t code_len = bi.read_bits(CHAR_BIT);
+	if (code_len < CHAR_BIT) {
+		throw invalid_file_format("wrong code length limit in archive");
+	}
+	return code_len;
+}
+
+// the sizes of the windows are read from a copy of the input, so memory is asked for only once and exactly;
+// every code takes at least a bit, so a window can't have more chars than bits
+size_t HuffmanDearchiver::count_window_chars(BitInputStream bi) const {
+	size_t result = 0;
+	try {
+		for (;;) {
+			size_t chars_cnt, bits;
+			read_varint(bi, chars_cnt);
+			if (chars_cnt == 0) {
+				return result;
+			}
+			read_varint(bi, bits);
+			if (chars_cnt > bits || chars_cnt > SIZE_MAX - result) {
+				throw invalid_file_format("wrong number of chars in archive");
+			}
+			result += chars_cnt;
+			bi.skip_bytes(bits / CHAR_BIT + (bits % CHAR_BIT != 0));
+		}
+	} catch (std::istream::failure &e) {
+		throw invalid_file_format("too few bits in input file");
+	}
+}
+
+HuffFileData HuffmanDearchiver::dearchive_blocks(BitInputStream &bi, ArchiveFormat format, std::ostream &out) {
+	HuffFileData result;
+	std::vector <size_t> blocks_sz, chars_cnt;
+	BlockHeader header;
+	for (read_block_header(bi, format, header); header.chars_cnt != 0; read_block_header(bi, format, header)) {
+		if (header.stored) {
+			copy_stored_block(bi, header.chars_cnt, out);
+		} else {
+			htree.rebuild_canonical(header.code_len);
+			decoder.rebuild(htree);
+			if (header.chars_cnt > get_max_chars_cnt(htree, header.payload_bits)) {
+				throw invalid_file_format("wrong number of chars in archive");
+			}
+
+			// the streams are just decoded one after another
+			const size_t segment_sz = get_segment_sz(header.chars_cnt, header.streams_bits.size());
+			for (size_t i = 0; i < header.streams_bits.size(); i++) {
+				size_t begin = std::min(i * segment_sz, header.chars_cnt);
+				size_t segment_chars_cnt = std::min(segment_sz, header.chars_cnt - begin);
+				if (decompress_file(bi, header.streams_bits[i], segment_chars_cnt, out) != segment_chars_cnt) {
+					throw invalid_file_format("wrong number of chars in archive");
+				}
+				bi.consume((CHAR_BIT - header.streams_bits[i] % CHAR_BIT) % CHAR_BIT);
+			}
+		}
+
+		blocks_sz.push_back(header.sz + header.payload_sz);
+		chars_cnt.push_back(header.chars_cnt);
+		result.input_sz += header.payload_sz;
+		result.output_sz += header.chars_cnt;
+		result.additional_sz += header.sz;
+	}
+	result.additional_sz += header.sz;
+	result.additional_sz += check_blocks_index(bi, blocks_sz, chars_cnt);
+	return result;
+}
+
+// the index is of no use when reading a stream, but it has to agree with the blocks
+size_t HuffmanDearchiver::check_blocks_index(BitInputStream &bi, const std::vector <size_t> &blocks_sz, const std::vector <size_t> &chars_cnt) const {
+	try {
+		size_t blocks_cnt, entry_sz, entry_chars_cnt;
+		size_t index_sz = read_varint(bi, blocks_cnt);
+		if (blocks_cnt != blocks_sz.size()) {
+			throw invalid_file_format("error while reading block index");
+		}
+		for (size_t i = 0; i < blocks_cnt; i++) {
+			index_sz += read_varint(bi, entry_sz);
+			index_sz += read_varint(bi, entry_chars_cnt);
+			if (entry_sz != blocks_sz[i] || entry_chars_cnt != chars_cnt[i]) {
+				throw invalid_file_format("error while reading block index");
+			}
+		}
+
+		size_t stored_index_sz = 0;
+		for (size_t i = 0; i < BLOCKS_INDEX_SIZE_BYTES; i++) {
+			stored_index_sz |= (size_t)bi.read_bits(CHAR_BIT) << (i * CHAR_BIT);
+		}
+		if (stored_index_sz != index_sz) {
+			throw invalid_file_format("error while reading block index");
+		}
+		for (char c : ARCHIVE_MAGIC) {
+			if (bi.read_bits(CHAR_BIT) != (unsigned char)c) {
+				throw invalid_file_format("error while reading block index");
+			}
+		}
+		if (!bi.at_end()) {
+			throw invalid_file_format("error while reading block index");
+		}
+		return index_sz + BLOCKS_INDEX_SIZE_BYTES + ARCHIVE_MAGIC_SZ;
+
+	} catch (std::istream::failure &e) {
+		throw invalid_file_format("error while reading block index");
+	}
+}
+
+bool HuffmanDearchiver::is_blocks_archive(std::span <const unsigned char> in) const {
+	return in.size() > ARCHIVE_MAGIC_SZ && std::equal(ARCHIVE_MAGIC, ARCHIVE_MAGIC + ARCHIVE_MAGIC_SZ, in.begin())
+	       && (in[ARCHIVE_MAGIC_SZ] == (unsigned char)ArchiveFormat::BLOCKS || in[ARCHIVE_MAGIC_SZ] == (unsigned char)ArchiveFormat::INTERLEAVED);
+}
+
+// Decodes the blocks in batches, all the blocks of a batch at once.
+HuffFileData HuffmanDearchiver::dearchive_blocks(std::span <const unsigned char> in, ArchiveFormat format, std::ostream &out) const {
+	std::vector <size_t> offsets, out_offsets;
+	read_blocks_index(in, offsets, out_offsets);
+
+	HuffFileData result;
+	const size_t blocks_cnt = offsets.size() - 1;
+	const size_t batch_blocks = parallel::get_threads_cnt(threads_cnt) * BATCH_BLOCKS_PER_THREAD;
+	std::vector <unsigned char> buffer;
+	for (size_t first = 0; first < blocks_cnt; first += batch_blocks) {
+		size_t last = std::min(first + batch_blocks, blocks_cnt);
+		buffer.resize(out_offsets[last] - out_offsets[first]);
+		result.input_sz += decode_blocks(in, format, offsets, out_offsets, first, last, buffer);
+		out.write((const char*)buffer.data(), buffer.size());
+	}
+
+	result.output_sz = out_offsets.back();
+	result.additional_sz = ARCHIVE_MAGIC_SZ + 1 + in.size() - result.input_sz;
+	return result;
+}
+
+HuffFileData HuffmanDearchiver::dearchive_blocks(std::span <const unsigned char> in, ArchiveFormat format, const OutputProvider &get_output) const {
+	std::vector <size_t> offsets, out_offsets;
+	read_blocks_index(in, offsets, out_offsets);
+
+	HuffFileData result;
+	result.output_sz = out_offsets.back();
+	std::span <unsigned char> out = get_output(result.output_sz);
+	result.input_sz = decode_blocks(in, format, offsets, out_offsets, 0, offsets.size() - 1, out);
+	result.additional_sz = ARCHIVE_MAGIC_SZ + 1 + in.size() - result.input_sz;
+	return result;
+}
+
+void HuffmanDearchiver::read_blocks_index(std::span <const unsigned char> in, std::vector <size_t> &offsets, std::vector <size_t> &out_offsets) const {
+	const size_t trailer_sz = BLOCKS_INDEX_SIZE_BYTES + ARCHIVE_MAGIC_SZ;
+	if (in.size() < trailer_sz || !std::equal(ARCHIVE_MAGIC, ARCHIVE_MAGIC + ARCHIVE_MAGIC_SZ, in.end() - ARCHIVE_MAGIC_SZ)) {
+		throw invalid_file_format("error while reading block index");
+	}
+
+	size_t index_sz = 0;
+	for (size_t i = 0; i < BLOCKS_INDEX_SIZE_BYTES; i++) {
+		index_sz |= (size_t)in[in.size() - trailer_sz + i] << (i * CHAR_BIT);
+	}
+	if (index_sz == 0 || index_sz >= in.size() - trailer_sz) {
+		throw invalid_file_format("error while reading block index");
+	}
+	const size_t blocks_end = in.size() - trailer_sz - index_sz - 1;
+	if (in[blocks_end] != 0) {
+		throw invalid_file_format("error while reading block index");
+	}
+
+	try {
+		BitInputStream bi(in.subspan(blocks_end + 1, index_sz));
+		size_t blocks_cnt, block_sz, chars_cnt;
+		read_varint(bi, blocks_cnt);
+		// an entry takes at least two bytes
+		if (blocks_cnt > index_sz / 2) {
+			throw invalid_file_format("error while reading block index");
+		}
+
+		offsets.assign(1, 0);
+		out_offsets.assign(1, 0);
+		for (size_t i = 0; i < blocks_cnt; i++) {
+			read_varint(bi, block_sz);
+			read_varint(bi, chars_cnt);
+			// every code is at least a bit long
+			if (block_sz > blocks_end - offsets.back() || chars_cnt > block_sz * CHAR_BIT) {
+				throw invalid_file_format("error while reading block index");
+			}
+			offsets.push_back(offsets.back() + block_sz);
+			out_offsets.push_back(out_offsets.back() + chars_cnt);
+		}
+		if (offsets.back() != blocks_end || !bi.at_end()) {
+			throw invalid_file_format("error while reading block index");
+		}
+
+	} catch (std::istream::failure &e) {
+		throw invalid_file_format("error while reading block index");
+	}
+}
+
+size_t HuffmanDearchiver::decode_blocks(std::span <const unsigned char> in, ArchiveFormat format, const std::vector <size_t> &offsets, const std::vector <size_t> &out_offsets,
+                                        size_t first, size_t last, std::span <unsigned char> out) const {
+	std::vector <size_t> payload_sz(last - first);
+	parallel::parallel_for(last - first, threads_cnt, [&](size_t i) {
+		size_t block = first + i;
+		payload_sz[i] = decode_block(in.subspan(offsets[block], offsets[block + 1] - offsets[block]), format,
+		                             out.subspan(out_offsets[block] - out_offsets[first], out_offsets[block + 1] - out_offsets[block]));
+	});
+	return std::accumulate(payload_sz.begin(), payload_sz.end(), (size_t)0);
+}
+
+// block is exactly the block, and out has room for exactly its chars
+size_t HuffmanDearchiver::decode_block(std::span <const unsigned char> block, ArchiveFormat format, std::span <unsigned char> out) const {
+	BitInputStream bi(block);
+	BlockHeader header;
+	try {
+		read_block_header(bi, format, header);
+	} catch (std::istream::failure &e) {
+		throw invalid_file_format("error while reading archive header");
+	}
+	if (header.chars_cnt == 0 || header.sz + header.payload_sz != block.size() || header.chars_cnt != out.size()) {
+		throw invalid_file_format("error while reading block index");
+	}
+	if (header.stored) {
+		std::memcpy(out.data(), block.data() + header.sz, header.chars_cnt);
+		return header.payload_sz;
+	}
+
+	HuffTree tree;
+	tree.rebuild_canonical(header.code_len);
+	HuffDecoder block_decoder;
+	block_decoder.rebuild(tree);
+	if (header.streams_bits.size() == 1) {
+		if (block_decoder.decode(bi, header.payload_bits, out) != header.chars_cnt) {
+			throw invalid_file_format("wrong number of chars in archive");
+		}
+		return header.payload_sz;
+	}
+
+	// every segment has a code at least a bit long for each of its chars, empty ones are skipped
+	std::vector <std::span <const unsigned char>> streams;
+	std::vector <size_t> streams_bits;
+	std::vector <std::span <unsigned char>> segments;
+	const size_t segment_sz = get_segment_sz(header.chars_cnt, header.streams_bits.size());
+	for (size_t i = 0, pos = header.sz; i < header.streams_bits.size(); i++) {
+		size_t bits = header.streams_bits[i], sz = (bits + CHAR_BIT - 1) / CHAR_BIT;
+		size_t begin = std::min(i * segment_sz, out.size());
+		std::span <unsigned char> segment = out.subspan(begin, std::min(segment_sz, out.size() - begin));
+		if (segment.size() > bits || (segment.empty() && bits > 0)) {
+			throw invalid_file_format("wrong number of chars in archive");
+		}
+		if (!segment.empty()) {
+			streams.push_back(block.subspan(pos, sz));
+			streams_bits.push_back(bits);
+			segments.push_back(segment);
+		}
+		pos += sz;
+	}
+	block_decoder.decode_interleaved(streams, streams_bits, segments);
+	return header.payload_sz;
+}
+
+void HuffmanDearchiver::read_block_header(BitInputStream &bi, ArchiveFormat format, BlockHeader &header) const {
+	header.stored = false;
+	header.sz = read_varint(bi, header.chars_cnt);
+	if (header.chars_cnt == 0) {
+		return;
+	}
+
+	if (bi.peek_bits(CHAR_BIT) == BLOCK_STORED) {
+		bi.consume(CHAR_BIT);
+		// keeps the sizes in bits from overflowing, like below
+		if (header.chars_cnt > (SIZE_MAX >> CHAR_BIT) / CHAR_BIT) {
+			throw invalid_file_format("size in archive header is too big");
 		}
-		result.push_back((unsigned char)buf);
+		header.stored = true;
+		header.code_len.clear();
+		header.streams_bits.assign(1, header.chars_cnt * CHAR_BIT);
+		header.payload_bits = header.chars_cnt * CHAR_BIT;
+		header.payload_sz = header.chars_cnt;
+		header.sz++;
+		return;
+	}
+	header.sz += read_code_lengths(bi, header.code_len);
+
+	size_t streams_cnt = 1;
+	if (format == ArchiveFormat::INTERLEAVED) {
+		streams_cnt = bi.read_bits(CHAR_BIT);
+		header.sz++;
+		if (streams_cnt == 0) {
+			throw invalid_file_format("block has no streams");
+		}
+	}
+
+	header.streams_bits.resize(streams_cnt);
+	header.payload_bits = header.payload_sz = 0;
+	for (size_t &bits : header.streams_bits) {
+		header.sz += read_varint(bi, bits);
+		// keeps the sums of the sizes of all the streams from overflowing
+		if (bits > SIZE_MAX >> CHAR_BIT) {
+			throw invalid_file_format("size in archive header is too big");
+		}
+		header.payload_bits += bits;
+		header.payload_sz += (bits + CHAR_BIT - 1) / CHAR_BIT;
+	}
+}
+
+void HuffmanDearchiver::copy_stored_block(BitInputStream &bi, size_t sz, std::ostream &out) const {
+	std::vector <unsigned char> buffer(std::min(sz, BUFFER_SZ));
+	try {
+		while (sz > 0) {
+			std::span <unsigned char> part = std::span <unsigned char> (buffer).first(std::min(sz, buffer.size()));
+			bi.read_bytes(part);
+			out.write((const char*)part.data(), part.size());
+			sz -= part.size();
+		}
+	} catch (std::istream::failure &e) {
+		throw invalid_file_format("too few bits in input file");
+	}
+}
+
+std::vector <unsigned char> HuffmanDearchiver::get_char_permutation_from_archive(BitInputStream &bi) const {
+	std::vector <unsigned char> result(CHARS_CNT);
+	try {
+		for (size_t i = 0; i < CHARS_CNT; i++) {
+			result[i] = bi.read_bits(CHAR_BIT);
+		}
+	} catch (std::istream::failure &e) {
+		throw invalid_file_format("error while reading char permutation");
 	}
 	return result;
 }
@@ -57,34 +582,99 @@ size_t HuffmanDearchiver::read_file_size(BitInputStream &bi) const {
 	return result;
 }
 
-size_t HuffmanDearchiver::decompress_file(BitInputStream &bi, size_t input_sz, std::ostream &out) const {
-	size_t output_sz = 0;
-	HuffTree::Node const *cur = htree.get_root();
+size_t HuffmanDearchiver::read_code_lengths(BitInputStream &bi, std::vector <unsigned char> &code_len) const {
+	const unsigned char known_flags = CANONICAL_NIBBLE_LENGTHS | CANONICAL_CHAR_LIST | CANONICAL_CHAR_BITMAP;
+	unsigned char flags = bi.read_bits(CHAR_BIT);
+	if ((flags & ~known_flags) || ((flags & CANONICAL_CHAR_LIST) && (flags & CANONICAL_CHAR_BITMAP))) {
+		throw invalid_file_format("unknown code lengths format");
+	}
+	const unsigned len_bits = (flags & CANONICAL_NIBBLE_LENGTHS) ? CHAR_BIT / 2 : CHAR_BIT;
 
-	try {
-		for (size_t i = 0; i < input_sz; i++) {
-			if (!bi.read_bit()) {
-				cur = cur->l;
-			} else {
-				cur = cur->r;
+	size_t result = 1;
+	std::vector <unsigned char> chars;
+	if (flags & CANONICAL_CHAR_LIST) {
+		size_t chars_cnt = bi.read_bits(CHAR_BIT);
+		for (size_t i = 0; i < chars_cnt; i++) {
+			chars.push_back(bi.read_bits(CHAR_BIT));
+			if (i > 0 && chars[i] <= chars[i - 1]) {
+				throw invalid_file_format("char list is not sorted");
+			}
+		}
+		result += 1 + chars_cnt;
+	} else if (flags & CANONICAL_CHAR_BITMAP) {
+		for (size_t i = 0; i < CHARS_CNT; i++) {
+			if (bi.read_bit()) {
+				chars.push_back(i);
 			}
+		}
+		result += CHARS_CNT / CHAR_BIT;
+	} else {
+		chars.resize(CHARS_CNT);
+		std::iota(chars.begin(), chars.end(), 0);
+	}
+
+	code_len.assign(CHARS_CNT, 0);
+	for (unsigned char c : chars) {
+		code_len[c] = bi.read_bits(len_bits);
+	}
+	bi.consume((CHAR_BIT - chars.size() * len_bits % CHAR_BIT) % CHAR_BIT);
+
+	return result + (chars.size() * len_bits + CHAR_BIT - 1) / CHAR_BIT;
+}
+
+size_t HuffmanDearchiver::read_varint(BitInputStream &bi, size_t &x) const {
+	const unsigned group_bits = CHAR_BIT - 1;
+	size_t result = 0;
+	x = 0;
+	for (unsigned shift = 0; ; shift += group_bits) {
+		unsigned char group = bi.read_bits(CHAR_BIT);
+		result++;
+		if (shift >= sizeof(x) * CHAR_BIT) {
+			throw invalid_file_format("size in archive header is too big");
+		}
+		x |= (size_t)(group & ((1 << group_bits) - 1)) << shift;
+		if (!(group >> group_bits)) {
+			return result;
+		}
+	}
+}
 
-			if (cur->term()) {
-				char to_write = (char)cur->ch;
-				out.write(&to_write, 1);
-				output_sz++;
-				cur = htree.get_root();
+// every char takes at least as many bits as the shortest code, i.e. the depth of the highest leaf
+size_t HuffmanDearchiver::get_max_chars_cnt(const HuffTree &tree, size_t input_sz) const {
+	std::vector <uint16_t> level{tree.get_root()}, next;
+	for (size_t depth = 0; !level.empty(); depth++) {
+		next.clear();
+		for (uint16_t v : level) {
+			const HuffTree::Node &node = tree.get_node(v);
+			if (node.term()) {
+				// a lone node without children is the tree of no chars
+				return depth > 0 ? input_sz / depth : 0;
+			}
+			for (uint16_t u : {node.l, node.r}) {
+				if (u != HuffTree::Node::NONE) {
+					next.push_back(u);
+				}
 			}
 		}
+		level.swap(next);
+	}
+	return 0;
+}
+
+size_t HuffmanDearchiver::decompress_file(BitInputStream &bi, size_t input_sz, size_t, std::ostream &out) const {
+	try {
+		return decoder.decode(bi, input_sz, out);
 	} catch (std::istream::failure &e) {
 		throw invalid_file_format("too few bits in input file");
 	}
+}
 
-	if (cur != htree.get_root()) {
-		throw invalid_file_format("unhandled chars at the end of file");
+size_t HuffmanDearchiver::decompress_file(BitInputStream &bi, size_t input_sz, size_t max_chars_cnt, const OutputProvider &get_output) const {
+	// the whole input is in memory, so a short one is caught before asking for output
+	if (input_sz > bi.bits_remaining()) {
+		throw invalid_file_format("too few bits in input file");
 	}
-
-	return output_sz;
+	return decoder.decode(bi, input_sz, get_output(max_chars_cnt));
 }
 
 }
\ No newline at end of file
@@ -0,0 +1,356 @@
+#include "huffman_incremental.h"
+#include <climits>
+#include <cstdint>
+#include <algorithm>
+#include <ios>
+
+namespace huffman {
+
+using huff_tree::CHARS_CNT;
+
+IncrementalDearchiver::Progress IncrementalDearchiver::decode(std::span <const unsigned char> in, std::span <unsigned char> out) {
+	Progress progress;
+	do {
+		take_input(in, progress.in_used);
+	} while (step(out, progress.out_used));
+	return progress;
+}
+
+bool IncrementalDearchiver::done() const {
+	return state == State::BLOCKS_INDEX || state == State::DONE;
+}
+
+HuffFileData IncrementalDearchiver::finish() {
+	if (state == State::BLOCKS_INDEX) {
+		if (index.empty()) {
+			throw invalid_file_format("error while reading block index");
+		}
+		BitInputStream bi(index);
+		result.additional_sz += parser.check_blocks_index(bi, blocks_sz, chars_cnt);
+		index.clear();
+		state = State::DONE;
+	}
+	if (state == State::PAYLOAD || state == State::ADAPTIVE_PAYLOAD) {
+		throw invalid_file_format("too few bits in input file");
+	}
+	if (state != State::DONE) {
+		throw invalid_file_format("error while reading archive header");
+	}
+	return result;
+}
+
+void IncrementalDearchiver::take_input(std::span <const unsigned char> in, size_t &in_used) {
+	std::span <const unsigned char> rest = in.subspan(in_used);
+	if (state == State::BLOCKS_INDEX) {
+		index.insert(index.end(), rest.begin(), rest.end());
+		in_used = in.size();
+		return;
+	}
+
+	// the buffer is refilled once half of it is decoded, so that the rest isn't moved too often
+	const size_t start = bit_pos / CHAR_BIT;
+	if (state == State::DONE || rest.empty() || buffer.size() - start > BUFFER_SZ / 2) {
+		return;
+	}
+	buffer.erase(buffer.begin(), buffer.begin() + start);
+	bit_pos -= start * CHAR_BIT;
+
+	size_t sz = std::min(rest.size(), BUFFER_SZ - buffer.size());
+	buffer.insert(buffer.end(), rest.begin(), rest.begin() + sz);
+	in_used += sz;
+}
+
+bool IncrementalDearchiver::step(std::span <unsigned char> out, size_t &out_used) {
+	switch (state) {
+	case State::MAGIC:
+		return read_magic();
+	case State::LEGACY_HEADER:
+		return read_legacy_header();
+	case State::CANONICAL_HEADER:
+		return read_canonical_header();
+	case State::BLOCK_HEADER:
+		return read_block_header();
+	case State::PERIODIC_HEADER:
+		return read_periodic_header();
+	case State::WINDOW_HEADER:
+		return read_window_header();
+	case State::PAYLOAD:
+		return decode_payload(out, out_used);
+	case State::ADAPTIVE_PAYLOAD:
+		return decode_adaptive(out, out_used);
+	default:
+		return false;
+	}
+}
+
+template <class Read>
+bool IncrementalDearchiver::parse(Read read) {
+	std::span <const unsigned char> data = std::span <const unsigned char> (buffer).subspan(bit_pos / CHAR_BIT);
+	if (data.empty()) {
+		return false;
+	}
+	try {
+		BitInputStream bi(data);
+		bit_pos += read(bi) * CHAR_BIT;
+		return true;
+	} catch (std::ios_base::failure &e) {
+		return false;
+	}
+}
+
+bool IncrementalDearchiver::read_magic() {
+	// a legacy archive may be told apart before the whole magic arrives
+	const size_t sz = std::min(buffer.size(), ARCHIVE_MAGIC_SZ + 1);
+	if (!std::equal(buffer.begin(), buffer.begin() + std::min(sz, ARCHIVE_MAGIC_SZ), ARCHIVE_MAGIC)) {
+		state = State::LEGACY_HEADER;
+		return true;
+	}
+	if (sz <= ARCHIVE_MAGIC_SZ) {
+		return false;
+	}
+
+	format = (ArchiveFormat)buffer[ARCHIVE_MAGIC_SZ];
+	if (format == ArchiveFormat::CANONICAL) {
+		state = State::CANONICAL_HEADER;
+	} else if (format == ArchiveFormat::BLOCKS || format == ArchiveFormat::INTERLEAVED) {
+		state = State::BLOCK_HEADER;
+	} else if (format == ArchiveFormat::ADAPTIVE) {
+		state = State::ADAPTIVE_PAYLOAD;
+	} else if (format == ArchiveFormat::PERIODIC) {
+		state = State::PERIODIC_HEADER;
+	} else {
+		throw invalid_file_format("unknown archive format version");
+	}
+	bit_pos += sz * CHAR_BIT;
+	result.additional_sz += sz;
+	return true;
+}
+
+bool IncrementalDearchiver::read_legacy_header() {
+	// the char permutation, the tree tour padded to bytes and the payload size
+	const size_t header_sz = CHARS_CNT + ((CHARS_CNT * 2 - 2) * 2 + CHAR_BIT - 1) / CHAR_BIT + sizeof(size_t);
+	if (buffer.size() - bit_pos / CHAR_BIT < header_sz) {
+		return false;
+	}
+
+	BitInputStream bi(std::span <const unsigned char> (buffer).subspan(bit_pos / CHAR_BIT, header_sz));
+	std::vector <unsigned char> ch_perm = parser.get_char_permutation_from_archive(bi);
+	std::vector <bool> tree = parser.get_tree_tour(bi);
+	htree.rebuild(ch_perm, tree);
+	decoder.rebuild(htree);
+	bits_left = parser.read_file_size(bi);
+	chars_left = parser.get_max_chars_cnt(htree, bits_left);
+	exact_chars_cnt = false;
+
+	bit_pos += header_sz * CHAR_BIT;
+	result.input_sz = (bits_left + CHAR_BIT - 1) / CHAR_BIT;
+	result.additional_sz = header_sz;
+	state = State::PAYLOAD;
+	return true;
+}
+
+bool IncrementalDearchiver::read_canonical_header() {
+	std::vector <unsigned char> code_len;
+	size_t input_sz_bits, chars_cnt;
+	size_t header_sz = 0;
+	bool read = parse([&](BitInputStream &bi) {
+		header_sz = parser.read_code_lengths(bi, code_len);
+		header_sz += parser.read_varint(bi, input_sz_bits);
+		header_sz += parser.read_varint(bi, chars_cnt);
+		return header_sz;
+	});
+	if (!read) {
+		return false;
+	}
+
+	htree.rebuild_canonical(code_len);
+	decoder.rebuild(htree);
+	if (chars_cnt > parser.get_max_chars_cnt(htree, input_sz_bits)) {
+		throw invalid_file_format("wrong number of chars in archive");
+	}
+	bits_left = input_sz_bits;
+	chars_left = chars_cnt;
+
+	result.input_sz = (input_sz_bits + CHAR_BIT - 1) / CHAR_BIT;
+	result.additional_sz += header_sz;
+	state = State::PAYLOAD;
+	return true;
+}
+
+bool IncrementalDearchiver::read_block_header() {
+	bool read = parse([&](BitInputStream &bi) {
+		parser.read_block_header(bi, format, block);
+		return block.sz;
+	});
+	if (!read) {
+		return false;
+	}
+	result.additional_sz += block.sz;
+
+	if (block.chars_cnt == 0) {
+		index.assign(buffer.begin() + bit_pos / CHAR_BIT, buffer.end());
+		buffer.clear();
+		bit_pos = 0;
+		state = State::BLOCKS_INDEX;
+		return true;
+	}
+
+	if (!block.stored) {
+		htree.rebuild_canonical(block.code_len);
+		decoder.rebuild(htree);
+		if (block.chars_cnt > parser.get_max_chars_cnt(htree, block.payload_bits)) {
+			throw invalid_file_format("wrong number of chars in archive");
+		}
+	}
+	result.input_sz += block.payload_sz;
+	segment = 0;
+	start_segment();
+	return true;
+}
+
+void IncrementalDearchiver::start_segment() {
+	const size_t segment_sz = get_segment_sz(block.chars_cnt, block.streams_bits.size());
+	size_t begin = std::min(segment * segment_sz, block.chars_cnt);
+	chars_left = std::min(segment_sz, block.chars_cnt - begin);
+	bits_left = block.streams_bits[segment];
+	state = State::PAYLOAD;
+}
+
+bool IncrementalDearchiver::read_periodic_header() {
+	bool read = parse([&](BitInputStream &bi) {
+		window_code_len = parser.read_window_code_len(bi);
+		return 1;
+	});
+	if (!read) {
+		return false;
+	}
+
+	htree.rebuild(CharCounter(), false, window_code_len);
+	result.additional_sz++;
+	state = State::WINDOW_HEADER;
+	return true;
+}
+
+bool IncrementalDearchiver::read_window_header() {
+	size_t window_chars_cnt, window_bits = 0;
+	size_t header_sz = 0;
+	bool read = parse([&](BitInputStream &bi) {
+		header_sz = parser.read_varint(bi, window_chars_cnt);
+		if (window_chars_cnt != 0) {
+			header_sz += parser.read_varint(bi, window_bits);
+		}
+		return header_sz;
+	});
+	if (!read) {
+		return false;
+	}
+	result.additional_sz += header_sz;
+
+	if (window_chars_cnt == 0) {
+		state = State::DONE;
+		return true;
+	}
+	decoder.rebuild(htree);
+	if (window_chars_cnt > parser.get_max_chars_cnt(htree, window_bits)) {
+		throw invalid_file_format("wrong number of chars in archive");
+	}
+	bits_left = window_bits;
+	chars_left = window_chars_cnt;
+	window_cnt = CharCounter();
+
+	result.input_sz += (window_bits + CHAR_BIT - 1) / CHAR_BIT;
+	state = State::PAYLOAD;
+	return true;
+}
+
+bool IncrementalDearchiver::decode_payload(std::span <unsigned char> out, size_t &out_used) {
+	if (bits_left == 0) {
+		end_stream();
+		return true;
+	}
+	if (chars_left == 0) {
+		throw invalid_file_format(exact_chars_cnt ? "wrong number of chars in archive" : "too many chars in input file");
+	}
+	const size_t avail_bits = buffer.size() * CHAR_BIT - bit_pos;
+	if (out_used == out.size() || avail_bits == 0) {
+		return false;
+	}
+	if (block.stored) {
+		return copy_stored(out, out_used);
+	}
+
+	BitInputStream bi(std::span <const unsigned char> (buffer).subspan(bit_pos / CHAR_BIT));
+	bi.consume(bit_pos % CHAR_BIT);
+	const size_t prev_bits_left = bits_left;
+	size_t sz = decoder.decode_partial(bi, bits_left, avail_bits, out.subspan(out_used, std::min(out.size() - out_used, chars_left)));
+
+	bit_pos += prev_bits_left - bits_left;
+	if (format == ArchiveFormat::PERIODIC) {
+		window_cnt.add_block(out.data() + out_used, sz);
+	}
+	chars_left -= sz;
+	out_used += sz;
+	result.output_sz += sz;
+	return sz > 0;
+}
+
+// a stored block is a stream of whole bytes that starts on a byte boundary
+bool IncrementalDearchiver::copy_stored(std::span <unsigned char> out, size_t &out_used) {
+	const size_t start = bit_pos / CHAR_BIT;
+	size_t sz = std::min({chars_left, out.size() - out_used, buffer.size() - start});
+	std::copy(buffer.begin() + start, buffer.begin() + start + sz, out.begin() + out_used);
+
+	bit_pos += sz * CHAR_BIT;
+	bits_left -= sz * CHAR_BIT;
+	chars_left -= sz;
+	out_used += sz;
+	result.output_sz += sz;
+	return sz > 0;
+}
+
+// a code cut by the end of the buffer is decoded again once more input arrives
+bool IncrementalDearchiver::decode_adaptive(std::span <unsigned char> out, size_t &out_used) {
+	const size_t prev_bit_pos = bit_pos;
+	size_t symbol = 0;
+	while (out_used < out.size() && adaptive_tree.decode(buffer, bit_pos, symbol)) {
+		if (symbol == AdaptiveHuffTree::END) {
+			state = State::DONE;
+			break;
+		}
+		out[out_used++] = symbol;
+		result.output_sz++;
+	}
+
+	adaptive_bits += bit_pos - prev_bit_pos;
+	result.input_sz = (adaptive_bits + CHAR_BIT - 1) / CHAR_BIT;
+	return bit_pos != prev_bit_pos;
+}
+
+void IncrementalDearchiver::end_stream() {
+	if (exact_chars_cnt && chars_left != 0) {
+		throw invalid_file_format("wrong number of chars in archive");
+	}
+	// windows are padded to a byte too, and the next one is coded with the tree of this one
+	if (format == ArchiveFormat::PERIODIC) {
+		bit_pos = (bit_pos + CHAR_BIT - 1) / CHAR_BIT * CHAR_BIT;
+		htree.rebuild(window_cnt, false, window_code_len);
+		state = State::WINDOW_HEADER;
+		return;
+	}
+	if (format != ArchiveFormat::BLOCKS && format != ArchiveFormat::INTERLEAVED) {
+		state = State::DONE;
+		return;
+	}
+
+	// every stream of a block is padded to a byte
+	bit_pos = (bit_pos + CHAR_BIT - 1) / CHAR_BIT * CHAR_BIT;
+	if (++segment < block.streams_bits.size()) {
+		start_segment();
+		return;
+	}
+	blocks_sz.push_back(block.sz + block.payload_sz);
+	chars_cnt.push_back(block.chars_cnt);
+	state = State::BLOCK_HEADER;
+}
+
+}
\ No newline at end of file
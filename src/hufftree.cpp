@@ -1,6 +1,8 @@
 #include "hufftree.h"
 #include "huffman_util.h"
-#include <cassert>
+#include "histogram.h"
+#include <algorithm>
+#include <stdexcept>
 
 namespace huff_tree {
 
@@ -14,92 +16,225 @@ void CharCounter::add_char(char ch) {
 	char_cnt[(unsigned char)ch]++;
 }
 
+void CharCounter::add_block(const unsigned char *buf, size_t sz) {
+	HistogramKernel kernel = get_histogram_kernel();
+	while (sz > 0) {
+		size_t len = std::min(sz, MAX_BLOCK_SZ);
+		kernel(buf, len, char_cnt);
+		buf += len;
+		sz -= len;
+	}
+}
+
+void CharCounter::merge(const CharCounter &other) {
+	for (size_t i = 0; i < CHARS_CNT; i++) {
+		char_cnt[i] += other.char_cnt[i];
+	}
+}
+
 size_t CharCounter::get_char_cnt(unsigned char ch) const {
 	return char_cnt[ch];
 }
 
+size_t CharCounter::get_total_cnt() const {
+	size_t result = 0;
+	for (size_t i = 0; i < CHARS_CNT; i++) {
+		result += char_cnt[i];
+	}
+	return result;
+}
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-HuffTree::Node::Node(): l(nullptr), r(nullptr), weight(0), ch(0) {}
+namespace {
 
-HuffTree::Node::Node(size_t w, unsigned char c): l(nullptr), r(nullptr), weight(w), ch(c) {}
+// the lightest of a range of roots, with the first and the last position that has its weight
+struct RangeMin {
+	size_t weight = 0;
+	size_t first = CHARS_CNT, last = CHARS_CNT;
 
-HuffTree::Node::Node(Node *left, Node *right): l(left), r(right), weight(0), ch(0) {
-	if (l) {
-		weight += l->weight;
+	bool empty() const {
+		return first == CHARS_CNT;
 	}
-	if (r) {
-		weight += r->weight;
-	}
-}
+};
 
-HuffTree::Node::~Node() {
-	delete l; delete r;
 }
 
+// Two segment trees over the positions of the roots, leaf pos at CHARS_CNT + pos. Their keys are
+// the weight and the position packed into one word, so the lightest root is a single min; in the
+// second tree positions count from the end, so that its min finds the last of the lightest roots.
+class HuffTree::RootWeights {
+public:
+	static constexpr unsigned POS_BITS = 8;
+	static constexpr uint64_t NONE = UINT64_MAX;
+
+	RootWeights() {
+		std::fill(std::begin(first_key), std::end(first_key), NONE);
+		std::fill(std::begin(last_key), std::end(last_key), NONE);
+	}
+
+	void set(size_t pos, size_t weight) {
+		weights[pos] = weight;
+		update(first_key, pos, (uint64_t)weight << POS_BITS | pos);
+		update(last_key, pos, (uint64_t)weight << POS_BITS | (CHARS_CNT - 1 - pos));
+	}
+
+	void clear(size_t pos) {
+		update(first_key, pos, NONE);
+		update(last_key, pos, NONE);
+	}
+
+	size_t get(size_t pos) const {
+		return weights[pos];
+	}
+
+	// over the positions [lo, hi)
+	RangeMin query(size_t lo, size_t hi) const {
+		uint64_t first = query(first_key, lo, hi), last = query(last_key, lo, hi);
+		RangeMin result;
+		if (first != NONE) {
+			const uint64_t pos_mask = ((uint64_t)1 << POS_BITS) - 1;
+			result.weight = first >> POS_BITS;
+			result.first = first & pos_mask;
+			result.last = CHARS_CNT - 1 - (last & pos_mask);
+		}
+		return result;
+	}
+
+private:
+	static_assert(CHARS_CNT == (size_t)1 << POS_BITS);
+
+	size_t weights[CHARS_CNT];
+	uint64_t first_key[CHARS_CNT * 2], last_key[CHARS_CNT * 2];
+
+	static void update(uint64_t *key, size_t pos, uint64_t value) {
+		size_t v = CHARS_CNT + pos;
+		key[v] = value;
+		for (v /= 2; v > 0; v /= 2) {
+			key[v] = std::min(key[2 * v], key[2 * v + 1]);
+		}
+	}
+
+	static uint64_t query(const uint64_t *key, size_t lo, size_t hi) {
+		uint64_t result = NONE;
+		for (lo += CHARS_CNT, hi += CHARS_CNT; lo < hi; lo /= 2, hi /= 2) {
+			if (lo % 2) {
+				result = std::min(result, key[lo++]);
+			}
+			if (hi % 2) {
+				result = std::min(result, key[--hi]);
+			}
+		}
+		return result;
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+HuffTree::Node::Node(): weight(0), l(NONE), r(NONE), ch(0) {}
+
+HuffTree::Node::Node(size_t w, unsigned char c): weight(w), l(NONE), r(NONE), ch(c) {}
+
 bool HuffTree::Node::term() const {
-	return l == nullptr && r == nullptr;
+	return l == NONE && r == NONE;
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-HuffTree::HuffTree() {}
-
-HuffTree::~HuffTree() {
-	delete root;
+HuffTree::HuffTree() {
+	nodes.reserve(MAX_NODES_CNT);
+	add_node();
 }
 
-void HuffTree::rebuild(const CharCounter &ccntr) {
-	delete root;
+HuffTree::~HuffTree() {}
+
+void HuffTree::rebuild(const CharCounter &ccntr, bool present_only, size_t max_code_len) {
+	nodes.clear();
+	for (size_t i = 0; i < CHARS_CNT; i++) {
+		if (!present_only || ccntr.get_char_cnt(i) > 0) {
+			add_node(ccntr.get_char_cnt(i), i);
+		}
+	}
+
+	// a lone char still needs a one-bit code
+	if (nodes.empty()) {
+		root = add_node();
+		build_char_codes();
+		return;
+	} else if (nodes.size() == 1) {
+		root = add_parent(0, Node::NONE);
+		build_char_codes();
+		return;
+	}
 
-	std::array <Node*, CHARS_CNT> roots;
-	size_t sz = CHARS_CNT;
+	// the leaves are the roots at first, in the order of their chars
+	std::array <uint16_t, CHARS_CNT> roots;
+	RootWeights weights;
+	size_t sz = nodes.size();
 	for (size_t i = 0; i < sz; i++) {
-		roots[i] = new Node(ccntr.get_char_cnt(i), i);
+		roots[i] = i;
+		weights.set(i, nodes[i].weight);
 	}
 
+	// the merges and the moves of the roots are those of the original builder, ties included,
+	// so the trees and legacy archives stay the same byte for byte
 	while (sz > 1) {
-		std::pair <size_t, size_t> cur = find_two_minimums(roots, sz);
-		Node *new_node = new Node(roots[cur.first], roots[cur.second]);
+		std::pair <size_t, size_t> cur = find_two_minimums(weights, sz);
+		roots[cur.first] = add_parent(roots[cur.first], roots[cur.second]);
+		weights.set(cur.first, nodes[roots[cur.first]].weight);
 
-		roots[cur.first] = new_node;
 		std::swap(roots[cur.second], roots[sz - 1]);
+		weights.set(cur.second, nodes[roots[cur.second]].weight);
+		weights.clear(sz - 1);
 		sz--;
 	}
-
 	root = roots[0];
 	build_char_codes();
+
+	if (max_code_len == 0) {
+		return;
+	}
+	for (size_t i = 0; i < CHARS_CNT; i++) {
+		if (char_code[i].size() > max_code_len) {
+			rebuild_canonical(get_limited_code_lengths(ccntr, present_only, max_code_len));
+			return;
+		}
+	}
 }
 
 void HuffTree::rebuild(const std::vector <unsigned char> &ch_perm, const std::vector <bool> &tree) {
-	delete root;
-	root = new Node();
-	std::vector <Node*> stck = {root};
-	size_t ptr = 0;
+	nodes.clear();
+	root = add_node();
+	std::array <uint16_t, MAX_NODES_CNT> stck;
+	size_t stck_sz = 0, ptr = 0;
+	stck[stck_sz++] = root;
 
 	try {
 		for (bool step : tree) {
-			if (stck.empty()) {
+			if (stck_sz == 0) {
 				throw huffman::invalid_file_format("tree processing failure");
 			}
-			Node *cur = stck.back();
+			uint16_t cur = stck[stck_sz - 1];
 
 			if (!step) {
-				if (cur->l == nullptr) {
-					cur->l = new Node();
-					stck.push_back(cur->l);
-				} else if (cur->r == nullptr) {
-					cur->r = new Node();
-					stck.push_back(cur->r);
+				if (nodes.size() == MAX_NODES_CNT) {
+					throw huffman::invalid_file_format("tree processing failure");
+				}
+				if (nodes[cur].l == Node::NONE) {
+					nodes[cur].l = add_node();
+					stck[stck_sz++] = nodes[cur].l;
+				} else if (nodes[cur].r == Node::NONE) {
+					nodes[cur].r = add_node();
+					stck[stck_sz++] = nodes[cur].r;
 				} else {
 					throw huffman::invalid_file_format("tree node has more than 2 children");
 				}
 			} else {
-				stck.pop_back();
+				stck_sz--;
 
-				if (cur->term()) {
-					cur->ch = ch_perm.at(ptr++);
-				} else if (cur->l == nullptr || cur->r == nullptr) {
+				if (nodes[cur].term()) {
+					nodes[cur].ch = ch_perm.at(ptr++);
+				} else if (nodes[cur].l == Node::NONE || nodes[cur].r == Node::NONE) {
 					throw huffman::invalid_file_format("tree node has less than 2 children");
 				}
 			}
@@ -108,7 +243,7 @@ void HuffTree::rebuild(const std::vector <unsigned char> &ch_perm, const std::ve
 		throw huffman::invalid_file_format("tree has too many characters");
 	}
 
-	if (stck.size() != 1 || stck[0] != root) {
+	if (stck_sz != 1 || stck[0] != root) {
 		throw huffman::invalid_file_format("tree processing failure");
 	}
 	if (ptr != ch_perm.size()) {
@@ -116,6 +251,62 @@ void HuffTree::rebuild(const std::vector <unsigned char> &ch_perm, const std::ve
 	}
 }
 
+void HuffTree::rebuild_canonical(const std::vector <unsigned char> &code_len) {
+	if (code_len.size() != CHARS_CNT) {
+		throw huffman::invalid_file_format("wrong number of code lengths");
+	}
+
+	std::array <unsigned char, CHARS_CNT> chars;
+	size_t chars_cnt = 0;
+	for (size_t i = 0; i < CHARS_CNT; i++) {
+		if (code_len[i] > 0) {
+			chars[chars_cnt++] = i;
+		}
+	}
+	std::sort(chars.begin(), chars.begin() + chars_cnt, [&code_len](unsigned char a, unsigned char b) {
+		return code_len[a] < code_len[b] || (code_len[a] == code_len[b] && a < b);
+	});
+
+	nodes.clear();
+	root = add_node();
+
+	// codes of the same length are consecutive numbers, first bit of the code is the most significant one
+	std::array <bool, CHARS_CNT> code{};
+	size_t code_sz = 0;
+	for (size_t i = 0; i < chars_cnt; i++) {
+		if (i > 0) {
+			size_t pos = code_sz;
+			while (pos > 0 && code[pos - 1]) {
+				code[--pos] = false;
+			}
+			if (pos == 0) {
+				throw huffman::invalid_file_format("code lengths are over-subscribed");
+			}
+			code[pos - 1] = true;
+		}
+		code_sz = code_len[chars[i]];
+
+		uint16_t cur = root;
+		for (size_t j = 0; j < code_sz; j++) {
+			uint16_t next = code[j] ? nodes[cur].r : nodes[cur].l;
+			if (next == Node::NONE) {
+				next = add_node();
+				(code[j] ? nodes[cur].r : nodes[cur].l) = next;
+			}
+			cur = next;
+		}
+		nodes[cur].ch = chars[i];
+	}
+
+	// the only incomplete code allowed is the one-bit code of a lone char
+	bool lone_char = chars_cnt == 1 && code_sz == 1;
+	if (!lone_char && std::find(code.begin(), code.begin() + code_sz, false) != code.begin() + code_sz) {
+		throw huffman::invalid_file_format("code lengths are incomplete");
+	}
+
+	build_char_codes();
+}
+
 std::vector <bool> HuffTree::get_compressed_tree() const {
 	std::vector <bool> tree;
 	get_tree_chars(root, tree);
@@ -127,82 +318,189 @@ const std::vector <bool>& HuffTree::get_char_code(unsigned char ch) const {
 	return char_code[ch];
 }
 
-HuffTree::Node const * HuffTree::get_root() const {
+std::vector <unsigned char> HuffTree::get_code_lengths() const {
+	std::vector <unsigned char> result(CHARS_CNT);
+	for (size_t i = 0; i < CHARS_CNT; i++) {
+		result[i] = char_code[i].size();
+	}
+	return result;
+}
+
+const PackedCode* HuffTree::get_packed_codes() const {
+	return packed_code;
+}
+
+uint16_t HuffTree::get_root() const {
 	return root;
 }
 
-std::pair <size_t, size_t> HuffTree::find_two_minimums(const std::array <Node*, CHARS_CNT> &roots, size_t sz) const {
-	assert(sz >= 2);
+const HuffTree::Node& HuffTree::get_node(uint16_t v) const {
+	return nodes[v];
+}
+
+std::span <const HuffTree::Node> HuffTree::get_nodes() const {
+	return nodes;
+}
 
-	std::pair <size_t, size_t> result = {0, 1};
-	if (roots[0]->weight > roots[1]->weight) {
-		result = {1, 0};
+// Package-merge: list j holds the leaves merged with the pairs of list j - 1, all sorted by weight.
+// The optimal code takes the 2n - 2 lightest items of the last list, each pair taken from list j
+// brings in its two items of list j - 1, and every time a leaf is taken its code grows by one bit.
+// The leaves taken from a list are always its lightest ones, so only the item kinds are kept.
+std::vector <unsigned char> HuffTree::get_limited_code_lengths(const CharCounter &ccntr, bool present_only, size_t max_code_len) const {
+	std::vector <unsigned char> chars;
+	for (size_t i = 0; i < CHARS_CNT; i++) {
+		if (!present_only || ccntr.get_char_cnt(i) > 0) {
+			chars.push_back(i);
+		}
+	}
+	std::sort(chars.begin(), chars.end(), [&ccntr](unsigned char a, unsigned char b) {
+		size_t wa = ccntr.get_char_cnt(a), wb = ccntr.get_char_cnt(b);
+		return wa < wb || (wa == wb && a < b);
+	});
+
+	const size_t n = chars.size();
+	if (max_code_len < CHAR_BIT && ((size_t)1 << max_code_len) < n) {
+		throw std::invalid_argument("max code length is too small for the alphabet");
 	}
 
-	for (size_t i = 2; i < sz; i++) {
-		if (roots[i]->weight <= roots[result.first]->weight) {
-			result.second = result.first; result.first = i;
-		} else if (roots[i]->weight < roots[result.second]->weight) {
-			result.second = i;
+	std::vector <size_t> list(n), next;
+	std::vector <std::vector <bool>> is_leaf(max_code_len);
+	for (size_t i = 0; i < n; i++) {
+		list[i] = ccntr.get_char_cnt(chars[i]);
+	}
+	is_leaf[0].assign(n, true);
+
+	for (size_t j = 1; j < max_code_len; j++) {
+		next.clear();
+		size_t leaf = 0, pair = 0, pairs_cnt = list.size() / 2;
+		while (leaf < n || pair < pairs_cnt) {
+			size_t pair_weight = pair < pairs_cnt ? list[pair * 2] + list[pair * 2 + 1] : 0;
+			if (pair == pairs_cnt || (leaf < n && ccntr.get_char_cnt(chars[leaf]) <= pair_weight)) {
+				next.push_back(ccntr.get_char_cnt(chars[leaf++]));
+				is_leaf[j].push_back(true);
+			} else {
+				next.push_back(pair_weight);
+				is_leaf[j].push_back(false);
+				pair++;
+			}
 		}
+		list.swap(next);
 	}
 
-	assert(result.first != result.second);
-	
+	std::vector <unsigned char> result(CHARS_CNT);
+	size_t take = n > 1 ? n * 2 - 2 : n;
+	for (size_t j = max_code_len; j-- > 0 && take > 0; ) {
+		size_t leaves_taken = 0;
+		for (size_t k = 0; k < take && k < is_leaf[j].size(); k++) {
+			leaves_taken += is_leaf[j][k];
+		}
+		for (size_t i = 0; i < leaves_taken; i++) {
+			result[chars[i]]++;
+		}
+		take = (take - leaves_taken) * 2;
+	}
 	return result;
 }
 
+uint16_t HuffTree::add_node(size_t w, unsigned char c) {
+	nodes.emplace_back(w, c);
+	return nodes.size() - 1;
+}
+
+// The two lightest of the first sz roots, as a scan from left to right picks them: the lightest root
+// is the last one of the lowest weight, though of roots 0 and 1 alone it's root 0 on a tie, and the
+// second one is the lightest before it took over or the first lighter one after it.
+std::pair <size_t, size_t> HuffTree::find_two_minimums(const RootWeights &weights, size_t sz) const {
+	size_t first = 0, second = 1;
+	if (weights.get(0) > weights.get(1)) {
+		std::swap(first, second);
+	}
+
+	RangeMin rest = weights.query(2, sz);
+	if (rest.empty() || rest.weight > weights.get(first)) {
+		if (!rest.empty() && rest.weight < weights.get(second)) {
+			second = rest.first;
+		}
+		return {first, second};
+	}
+
+	size_t last = rest.last;
+	RangeMin before = weights.query(2, last);
+	if (!before.empty() && before.weight <= weights.get(first)) {
+		first = before.last;
+	}
+	RangeMin after = weights.query(last + 1, sz);
+	second = !after.empty() && after.weight < weights.get(first) ? after.first : first;
+	return {last, second};
+}
+
+uint16_t HuffTree::add_parent(uint16_t left, uint16_t right) {
+	uint16_t v = add_node(nodes[left].weight + (right != Node::NONE ? nodes[right].weight : 0), 0);
+	nodes[v].l = left; nodes[v].r = right;
+	return v;
+}
+
 void HuffTree::build_char_codes() {
 	const size_t sz = CHARS_CNT;
 	for (size_t i = 0; i < sz; i++) {
-		std::vector <bool> ().swap(char_code[i]);
+		char_code[i].clear();
 	}
 
-	std::vector <bool> cur_code;
-	build_char_codes_dfs(root, cur_code);
+	std::array <bool, CHARS_CNT> cur_code;
+	build_char_codes_dfs(root, cur_code, 0);
+
+	for (size_t i = 0; i < sz; i++) {
+		const std::vector <bool> &code = char_code[i];
+		packed_code[i] = PackedCode();
+		packed_code[i].len = code.size();
+		for (size_t j = 0; j < code.size() && j < PackedCode::MAX_LEN; j++) {
+			packed_code[i].code |= (uint64_t)code[j] << j;
+		}
+	}
 }
 
-void HuffTree::build_char_codes_dfs(Node *v, std::vector <bool> &cur_code) {
-	if (v->term()) {
-		std::copy(cur_code.begin(), cur_code.end(), std::back_inserter(char_code[v->ch]));
+void HuffTree::build_char_codes_dfs(uint16_t v, std::array <bool, CHARS_CNT> &cur_code, size_t depth) {
+	const Node &node = nodes[v];
+	if (node.term()) {
+		char_code[node.ch].assign(cur_code.begin(), cur_code.begin() + depth);
 	}
 
-	if (v->l != nullptr) {
-		cur_code.push_back(false);
-		build_char_codes_dfs(v->l, cur_code);
-		cur_code.pop_back();
+	if (node.l != Node::NONE) {
+		cur_code[depth] = false;
+		build_char_codes_dfs(node.l, cur_code, depth + 1);
 	}
-	if (v->r != nullptr) {
-		cur_code.push_back(true);
-		build_char_codes_dfs(v->r, cur_code);
-		cur_code.pop_back();
+	if (node.r != Node::NONE) {
+		cur_code[depth] = true;
+		build_char_codes_dfs(node.r, cur_code, depth + 1);
 	}
 }
 
-void HuffTree::get_tree_chars(Node *v, std::vector <bool> &chars) const {
-	if (v->term()) {
+void HuffTree::get_tree_chars(uint16_t v, std::vector <bool> &chars) const {
+	const Node &node = nodes[v];
+	if (node.term()) {
 		for (size_t i = 0; i < CHAR_BIT; i++) {
-			chars.push_back(v->ch & (1 << i));
+			chars.push_back(node.ch & (1 << i));
 		}
 	}
 
-	if (v->l != nullptr) {
-		get_tree_chars(v->l, chars);
+	if (node.l != Node::NONE) {
+		get_tree_chars(node.l, chars);
 	}
-	if (v->r != nullptr) {
-		get_tree_chars(v->r, chars);
+	if (node.r != Node::NONE) {
+		get_tree_chars(node.r, chars);
 	}
 }
 
-void HuffTree::get_tree_tour(Node *v, std::vector <bool> &tree) const {
-	if (v->l != nullptr) {
+void HuffTree::get_tree_tour(uint16_t v, std::vector <bool> &tree) const {
+	const Node &node = nodes[v];
+	if (node.l != Node::NONE) {
 		tree.push_back(0);
-		get_tree_tour(v->l, tree);
+		get_tree_tour(node.l, tree);
 		tree.push_back(1);
 	}
-	if (v->r != nullptr) {
+	if (node.r != Node::NONE) {
 		tree.push_back(0);
-		get_tree_tour(v->r, tree);
+		get_tree_tour(node.r, tree);
 		tree.push_back(1);
 	}
 }
@@ -1,55 +1,151 @@
 #include "huffman.h"
 #include "arg_utils.h"
+#include "mapped_file.h"
 #include <iostream>
 #include <fstream>
+#include <charconv>
 
 using arg_utils::Arguments;
 using arg_utils::process_args;
 
-static huffman::HuffFileData archive(const std::string_view &input, const std::string_view &output) {
-	std::ifstream in(input.data());
-	if (in.fail()) {
-		throw std::invalid_argument("Input file doesn't exist or can't be opened");
+static huffman::ArchiveFormat parse_format(const std::string_view &format) {
+	if (format == "legacy") {
+		return huffman::ArchiveFormat::LEGACY;
+	}
+	if (format == "canonical") {
+		return huffman::ArchiveFormat::CANONICAL;
+	}
+	if (format == "blocks") {
+		return huffman::ArchiveFormat::BLOCKS;
+	}
+	if (format == "interleaved") {
+		return huffman::ArchiveFormat::INTERLEAVED;
 	}
+	if (format == "periodic") {
+		return huffman::ArchiveFormat::PERIODIC;
+	}
+	throw std::invalid_argument("Unknown archive format (--format)");
+}
 
-	std::ofstream out(output.data());
-	if (out.fail()) {
-		throw std::invalid_argument("Output file can't be opened");
+static size_t parse_number(const std::string_view &s, const char *error) {
+	size_t result = 0;
+	auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), result);
+	if (ec != std::errc() || end != s.data() + s.size()) {
+		throw std::invalid_argument(error);
 	}
-	
-	huffman::HuffmanArchiver a;
-	return a.archive(in, out);
+	return result;
 }
 
-static huffman::HuffFileData dearchive(const std::string_view &input, const std::string_view &output) {
-	std::ifstream in(input.data());
-	if (in.fail()) {
+// "-" is stdin or stdout
+static std::istream &open_input(const std::string_view &input, std::ifstream &file) {
+	if (input == arg_utils::STDIO_FILE) {
+		return std::cin;
+	}
+	file.open(input.data());
+	if (file.fail()) {
 		throw std::invalid_argument("Input file doesn't exist or can't be opened");
 	}
+	return file;
+}
 
-	std::ofstream out(output.data());
-	if (out.fail()) {
+static std::ostream &open_output(const std::string_view &output, std::ofstream &file) {
+	if (output == arg_utils::STDIO_FILE) {
+		return std::cout;
+	}
+	file.open(output.data());
+	if (file.fail()) {
 		throw std::invalid_argument("Output file can't be opened");
 	}
+	return file;
+}
+
+// Regular files are mapped and processed in place, anything else is read or written as a stream.
+static huffman::HuffFileData archive(const std::string_view &input, const std::string_view &output, huffman::ArchiveFormat format, size_t max_code_len, size_t threads_cnt) {
+	huffman::HuffmanArchiver a;
+	a.set_format(format);
+	a.set_max_code_len(max_code_len);
+	a.set_threads_cnt(threads_cnt);
 
+	// an empty path is never mapped
+	file_io::MappedFile mapped(input == arg_utils::STDIO_FILE ? "" : input.data());
+	if (mapped.is_mapped() && output != arg_utils::STDIO_FILE) {
+		file_io::MappedOutputFile mapped_out(output.data());
+		if (mapped_out.is_open()) {
+			huffman::HuffFileData result = a.archive(mapped.get_data(), [&mapped_out](size_t sz) {
+				return mapped_out.map(sz);
+			});
+			mapped_out.close(result.output_sz + result.additional_sz);
+			return result;
+		}
+	}
+
+	std::ifstream in_file;
+	std::ofstream out_file;
+	if (mapped.is_mapped()) {
+		return a.archive(mapped.get_data(), open_output(output, out_file));
+	}
+	std::istream &in = open_input(input, in_file);
+	return a.archive(in, open_output(output, out_file));
+}
+
+static huffman::HuffFileData dearchive(const std::string_view &input, const std::string_view &output, size_t threads_cnt) {
 	huffman::HuffmanDearchiver d;
-	return d.dearchive(in, out);
+	d.set_threads_cnt(threads_cnt);
+
+	file_io::MappedFile mapped(input == arg_utils::STDIO_FILE ? "" : input.data());
+	if (mapped.is_mapped() && output != arg_utils::STDIO_FILE) {
+		file_io::MappedOutputFile mapped_out(output.data());
+		if (mapped_out.is_open()) {
+			huffman::HuffFileData result = d.dearchive(mapped.get_data(), [&mapped_out](size_t sz) {
+				return mapped_out.map(sz);
+			});
+			mapped_out.close(result.output_sz);
+			return result;
+		}
+	}
+
+	std::ifstream in_file;
+	std::ofstream out_file;
+	if (mapped.is_mapped()) {
+		return d.dearchive(mapped.get_data(), open_output(output, out_file));
+	}
+	std::istream &in = open_input(input, in_file);
+	return d.dearchive(in, open_output(output, out_file));
 }
 
 int main(int argc, char **argv) {
+	// lets std::cin tell how much input has arrived, which adaptive archiving relies on
+	std::ios_base::sync_with_stdio(false);
+
 	try {
 		Arguments args = process_args(argc, (const char**)argv);
 
+		// 0 threads means one per core
+		size_t threads_cnt = parse_number(args.get_threads(), "Invalid number of threads (--threads)");
+
 		huffman::HuffFileData data;
 		if (args.get_target() == "-c") {
-			data = archive(args.get_input_file(), args.get_output_file());
+			size_t max_code_len = parse_number(args.get_max_code_len(), "Invalid max code length (--max-code-len)");
+			// stdin can only be read once, which blocks formats need
+			huffman::ArchiveFormat format = huffman::ArchiveFormat::BLOCKS;
+			if (args.has_format() || args.get_input_file() != arg_utils::STDIO_FILE) {
+				format = parse_format(args.get_format());
+			}
+			data = archive(args.get_input_file(), args.get_output_file(), format, max_code_len, threads_cnt);
+		} else if (args.get_target() == "-a") {
+			if (args.has_format()) {
+				throw std::invalid_argument("Adaptive archives have a format of their own (-a)");
+			}
+			data = archive(args.get_input_file(), args.get_output_file(), huffman::ArchiveFormat::ADAPTIVE, 0, threads_cnt);
 		} else {
-			data = dearchive(args.get_input_file(), args.get_output_file());
+			data = dearchive(args.get_input_file(), args.get_output_file(), threads_cnt);
 		}
 
-		std::cout << data.input_sz << std::endl;
-		std::cout << data.output_sz << std::endl;
-		std::cout << data.additional_sz << std::endl;
+		// the stats don't go into an archive written to stdout
+		std::ostream &stats = args.get_output_file() == arg_utils::STDIO_FILE ? std::cerr : std::cout;
+		stats << data.input_sz << std::endl;
+		stats << data.output_sz << std::endl;
+		stats << data.additional_sz << std::endl;
 
 	} catch (std::invalid_argument &e) {
 		std::cerr << e.what() << std::endl;
@@ -0,0 +1,138 @@
+#include "mapped_file.h"
+#include <ios>
+
+#if __has_include(<sys/mman.h>)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define HUFF_HAS_MMAP
+#endif
+
+namespace file_io {
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+MappedFile::MappedFile(const char *path): addr(nullptr), sz(0) {
+#ifdef HUFF_HAS_MMAP
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p != MAP_FAILED) {
+			addr = p;
+			sz = st.st_size;
+			madvise(addr, sz, MADV_SEQUENTIAL);
+		}
+	}
+	// the mapping stays valid after the descriptor is closed
+	close(fd);
+#else
+	(void)path;
+#endif
+}
+
+MappedFile::~MappedFile() {
+#ifdef HUFF_HAS_MMAP
+	if (addr) {
+		munmap(addr, sz);
+	}
+#endif
+}
+
+bool MappedFile::is_mapped() const {
+	return addr != nullptr;
+}
+
+std::span <const unsigned char> MappedFile::get_data() const {
+	return std::span <const unsigned char> ((const unsigned char*)addr, sz);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+MappedOutputFile::MappedOutputFile(const char *path): fd(-1), addr(nullptr), sz(0) {
+#ifdef HUFF_HAS_MMAP
+	int f = open(path, O_RDWR | O_CREAT, 0666);
+	if (f < 0) {
+		return;
+	}
+
+	struct stat st;
+	if (fstat(f, &st) == 0 && S_ISREG(st.st_mode) && ftruncate(f, 0) == 0) {
+		fd = f;
+	} else {
+		::close(f);
+	}
+#else
+	(void)path;
+#endif
+}
+
+MappedOutputFile::~MappedOutputFile() {
+#ifdef HUFF_HAS_MMAP
+	unmap();
+	if (fd >= 0) {
+		::close(fd);
+	}
+#endif
+}
+
+bool MappedOutputFile::is_open() const {
+	return fd >= 0;
+}
+
+std::span <unsigned char> MappedOutputFile::map(size_t _sz) {
+#ifdef HUFF_HAS_MMAP
+	unmap();
+	if (ftruncate(fd, _sz) != 0) {
+		throw std::ios_base::failure("can't resize output file");
+	}
+	// an empty mapping isn't allowed, and there is nothing to write anyway
+	if (_sz == 0) {
+		return std::span <unsigned char> ();
+	}
+
+	void *p = mmap(nullptr, _sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		throw std::ios_base::failure("can't map output file");
+	}
+	addr = p;
+	sz = _sz;
+	madvise(addr, sz, MADV_SEQUENTIAL);
+	return std::span <unsigned char> ((unsigned char*)addr, sz);
+#else
+	(void)_sz;
+	throw std::ios_base::failure("can't map output file");
+#endif
+}
+
+void MappedOutputFile::close(size_t _sz) {
+#ifdef HUFF_HAS_MMAP
+	unmap();
+	if (ftruncate(fd, _sz) != 0) {
+		throw std::ios_base::failure("can't resize output file");
+	}
+	::close(fd);
+	fd = -1;
+#else
+	(void)_sz;
+#endif
+}
+
+void MappedOutputFile::unmap() {
+#ifdef HUFF_HAS_MMAP
+	if (addr) {
+		munmap(addr, sz);
+		addr = nullptr;
+		sz = 0;
+	}
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+}
\ No newline at end of file
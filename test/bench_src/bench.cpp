@@ -0,0 +1,80 @@
+#include "hufftree.h"
+#include "histogram.h"
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+using std::size_t;
+using std::mt19937;
+using std::vector;
+using std::string;
+
+using huff_tree::CHARS_CNT;
+using huff_tree::HistogramKernel;
+
+// Throughput of the histogram kernels against counting one char at a time, on 64 KiB blocks
+// like the archiver reads them.
+
+static const size_t DATA_SZ = 1 << 26;
+static const size_t BLOCK_SZ = 1 << 16;
+static const size_t ROUNDS = 5;
+
+static size_t total_cnt[CHARS_CNT];
+
+static void count_by_char(const unsigned char *buf, size_t sz, size_t *cnt) {
+	for (size_t i = 0; i < sz; i++) {
+		cnt[buf[i]]++;
+	}
+}
+
+static double measure(HistogramKernel kernel, const vector <unsigned char> &data) {
+	double best = 0;
+	for (size_t r = 0; r < ROUNDS; r++) {
+		auto start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < data.size(); i += BLOCK_SZ) {
+			kernel(data.data() + i, std::min(BLOCK_SZ, data.size() - i), total_cnt);
+		}
+		std::chrono::duration <double> t = std::chrono::steady_clock::now() - start;
+		double mb_per_s = data.size() / t.count() / (1 << 20);
+		best = std::max(best, mb_per_s);
+	}
+	return best;
+}
+
+static void run(const string &name, const vector <unsigned char> &data) {
+	std::printf("%-8s by char %8.0f MB/s, scalar %8.0f MB/s", name.c_str(), measure(count_by_char, data), measure(huff_tree::histogram_scalar, data));
+#ifdef HUFF_HISTOGRAM_X86
+	std::printf(", sse2 %8.0f MB/s", measure(huff_tree::histogram_sse2, data));
+	if (huff_tree::avx2_supported()) {
+		std::printf(", avx2 %8.0f MB/s", measure(huff_tree::histogram_avx2, data));
+	}
+#endif
+	std::printf("\n");
+}
+
+int main() {
+	mt19937 mtw(1);
+	vector <unsigned char> data(DATA_SZ);
+
+	for (unsigned char &c : data) {
+		c = ' ' + mtw() % 8 * mtw() % 95;
+	}
+	run("text", data);
+
+	for (unsigned char &c : data) {
+		c = mtw();
+	}
+	run("random", data);
+
+	for (size_t i = 0; i < data.size(); i++) {
+		data[i] = (i >> 12) % 2 ? mtw() : 0;
+	}
+	run("runs", data);
+
+	std::fill(data.begin(), data.end(), 'a');
+	run("one", data);
+
+	return 0;
+}
\ No newline at end of file
@@ -4,13 +4,23 @@
 #include "arg_utils.h"
 #include "bitio.h"
 #include "hufftree.h"
+#include "huffdecoder.h"
+#include "histogram.h"
 #include "huffman.h"
+#include "mapped_file.h"
+#include "parallel.h"
 #include <cstddef>
 #include <cstring>
+#include <cstdlib>
+#include <new>
 #include <random>
 #include <vector>
 #include <sstream>
 #include <functional>
+#include <fstream>
+#include <filesystem>
+#include <span>
+#include <bit>
 
 using std::size_t;
 using std::mt19937;
@@ -30,11 +40,35 @@ using bit_io::BitOutputStream;
 using huff_tree::CHARS_CNT;
 using huff_tree::CharCounter;
 using huff_tree::HuffTree;
+using huff_tree::HuffDecoder;
+using huff_tree::AdaptiveHuffTree;
 
 using huffman::HuffmanArchiver;
 using huffman::HuffmanDearchiver;
 using huffman::HuffFileData;
 using huffman::invalid_file_format;
+using huffman::ArchiveFormat;
+
+using file_io::MappedFile;
+using file_io::MappedOutputFile;
+
+static size_t allocations_cnt = 0;
+
+void* operator new(size_t sz) {
+	allocations_cnt++;
+	if (void *p = std::malloc(sz)) {
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept {
+	std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+	std::free(p);
+}
 
 TEST_SUITE("test arg_utils") {
 	TEST_CASE("test missing target") {
@@ -167,6 +201,92 @@ TEST_SUITE("test arg_utils") {
 		CHECK(args.get_output_file() == "b");
 	}
 
+	TEST_CASE("test missing format") {
+		const size_t N = 7;
+		const char *argv[N]{"hw_02", "-c", "-f", "a", "-o", "b", "--format"};
+
+		CHECK_THROWS_AS(process_args(N, argv), invalid_argument);
+	}
+
+	TEST_CASE("test multiple formats") {
+		const size_t N = 10;
+		const char *argv[N]{"hw_02", "-c", "-f", "a", "-o", "b", "--format", "legacy", "--format", "canonical"};
+
+		CHECK_THROWS_AS(process_args(N, argv), invalid_argument);
+	}
+
+	TEST_CASE("test format") {
+		const size_t N = 8;
+		const char *argv[N]{"hw_02", "-c", "--format", "canonical", "-f", "a", "-o", "b"};
+
+		Arguments args = process_args(N, argv);
+		CHECK(args.get_format() == "canonical");
+	}
+
+	TEST_CASE("test default format") {
+		const size_t N = 6;
+		const char *argv[N]{"hw_02", "-c", "-f", "a", "-o", "b"};
+
+		Arguments args = process_args(N, argv);
+		CHECK(args.get_format() == "legacy");
+		CHECK(args.get_max_code_len() == "0");
+		CHECK(args.get_threads() == "0");
+	}
+
+	TEST_CASE("test max code length") {
+		const size_t N = 8;
+		const char *argv[N]{"hw_02", "-c", "-f", "a", "--max-code-len", "11", "-o", "b"};
+
+		Arguments args = process_args(N, argv);
+		CHECK(args.get_max_code_len() == "11");
+	}
+
+	TEST_CASE("test multiple max code lengths") {
+		const size_t N = 10;
+		const char *argv[N]{"hw_02", "-c", "-f", "a", "-o", "b", "--max-code-len", "11", "--max-code-len", "12"};
+
+		CHECK_THROWS_AS(process_args(N, argv), invalid_argument);
+	}
+
+	TEST_CASE("test threads") {
+		const size_t N = 8;
+		const char *argv[N]{"hw_02", "-u", "--threads", "4", "-f", "a", "-o", "b"};
+
+		Arguments args = process_args(N, argv);
+		CHECK(args.get_threads() == "4");
+	}
+
+	TEST_CASE("test missing threads") {
+		const size_t N = 7;
+		const char *argv[N]{"hw_02", "-u", "-f", "a", "-o", "b", "--threads"};
+
+		CHECK_THROWS_AS(process_args(N, argv), invalid_argument);
+	}
+
+	TEST_CASE("test stdio files") {
+		const size_t N = 6;
+		const char *argv[N]{"hw_02", "-c", "-f", "-", "-o", "-"};
+
+		Arguments args = process_args(N, argv);
+		CHECK(args.get_input_file() == arg_utils::STDIO_FILE);
+		CHECK(args.get_output_file() == arg_utils::STDIO_FILE);
+		CHECK(!args.has_format());
+
+		const char *argv_format[N + 2]{"hw_02", "-c", "-f", "-", "-o", "b", "--format", "legacy"};
+		CHECK(process_args(N + 2, argv_format).has_format());
+	}
+
+	TEST_CASE("test adaptive target") {
+		const size_t N = 6;
+		const char *argv[N]{"hw_02", "-f", "a", "-a", "-o", "b"};
+
+		Arguments args = process_args(N, argv);
+		CHECK(args.get_target() == "-a");
+
+		const char *argv_multiple[N + 1]{"hw_02", "-a", "-c", "-f", "a", "-o", "b"};
+		CHECK_THROWS_AS(process_args(N + 1, argv_multiple), invalid_argument);
+	}
+
 	TEST_CASE("test correct input 7") {
 		const size_t N = 6;
 		const char *argv[N]{"hw_02", "-o", "a", "-f", "b", "-u"};
@@ -274,6 +394,231 @@ TEST_SUITE("test bit_io") {
 
 		CHECK(0);
 	}
+
+	TEST_CASE("test bit_io write_bits 1") {
+		stringstream str;
+
+		{
+			BitOutputStream bo(str);
+			bo.write_bits(0b1011, 4);
+			bo.write_bits(0b01, 2);
+			bo.write_bits(0xFFFF, 3);
+		}
+
+		bool expected[9]{1, 1, 0, 1, 1, 0, 1, 1, 1};
+		BitInputStream bi(str);
+		for (size_t i = 0; i < 9; i++) {
+			CHECK(bi.read_bit() == expected[i]);
+		}
+		CHECK(str.str().size() == 2);
+	}
+
+	TEST_CASE("test bit_io write_bits 2") {
+		const size_t N = 100000;
+		mt19937 mtw(7);
+		vector <std::pair <uint64_t, unsigned>> codes;
+		for (size_t i = 0; i < N; i++) {
+			unsigned len = mtw() % 65;
+			uint64_t bits = ((uint64_t)mtw() << 32) | mtw();
+			codes.push_back({bits, len});
+		}
+
+		stringstream by_words, by_bits;
+
+		{
+			BitOutputStream bo(by_words);
+			for (auto [bits, len] : codes) {
+				bo.write_bits(bits, len);
+			}
+		}
+
+		{
+			BitOutputStream bo(by_bits);
+			for (auto [bits, len] : codes) {
+				for (unsigned i = 0; i < len; i++) {
+					bo.write_bit((bits >> i) & 1);
+				}
+			}
+		}
+
+		CHECK(by_words.str() == by_bits.str());
+	}
+
+	TEST_CASE("test bit_io write_bits 3") {
+		stringstream str;
+
+		{
+			BitOutputStream bo(str);
+			bo.write_bit(1);
+			bo.write_bits(0x8000000000000001ull, 64);
+			bo.write_bits(0, 0);
+			bo.write_bit(1);
+		}
+
+		CHECK(str.str().size() == 9);
+
+		BitInputStream bi(str);
+		CHECK(bi.read_bit() == 1);
+		CHECK(bi.read_bit() == 1);
+		for (size_t i = 0; i < 62; i++) {
+			CHECK(bi.read_bit() == 0);
+		}
+		CHECK(bi.read_bit() == 1);
+		CHECK(bi.read_bit() == 1);
+	}
+
+	TEST_CASE("test bit_io flush") {
+		stringstream str;
+		BitOutputStream bo(str);
+
+		bo.write_bits(0b101, 3);
+		bo.flush();
+		CHECK(str.str() == string(1, (char)0b101));
+
+		bo.write_bits(0b11, 2);
+		bo.flush();
+		CHECK(str.str() == string(1, (char)0b101) + string(1, (char)0b11));
+	}
+
+	TEST_CASE("test bit_io peek/consume 1") {
+		stringstream str;
+
+		{
+			BitOutputStream bo(str);
+			bo.write_bits(0b1101, 4);
+			bo.write_bits(0x1234567, 28);
+			bo.write_bits(0b10, 2);
+		}
+
+		BitInputStream bi(str);
+		CHECK(bi.peek_bits(4) == 0b1101);
+		CHECK(bi.peek_bits(4) == 0b1101);
+		bi.consume(4);
+		CHECK(bi.peek_bits(28) == 0x1234567);
+		bi.consume(28);
+		CHECK(bi.bits_remaining() == 8);
+		CHECK(bi.read_bit() == 0);
+		CHECK(bi.peek_bits(12) == 0b1);
+		bi.consume(7);
+		CHECK(bi.bits_remaining() == 0);
+		CHECK(bi.peek_bits(5) == 0);
+
+		CHECK_THROWS_WITH_AS(bi.consume(1), "no bits left in input: iostream error", istream::failure);
+	}
+
+	TEST_CASE("test bit_io peek/consume 2") {
+		const size_t N = 50000;
+		mt19937 mtw(9);
+		vector <std::pair <uint64_t, unsigned>> codes;
+		for (size_t i = 0; i < N; i++) {
+			unsigned len = mtw() % (BitInputStream::MAX_PEEK_BITS + 1);
+			uint64_t bits = (((uint64_t)mtw() << 32) | mtw()) & (((uint64_t)1 << len) - 1);
+			codes.push_back({bits, len});
+		}
+
+		stringstream str;
+
+		{
+			BitOutputStream bo(str);
+			for (auto [bits, len] : codes) {
+				bo.write_bits(bits, len);
+			}
+		}
+
+		BitInputStream bi(str);
+		for (auto [bits, len] : codes) {
+			REQUIRE(bi.peek_bits(len) == bits);
+			bi.consume(len);
+		}
+		CHECK(bi.bits_remaining() < CHAR_BIT);
+	}
+
+	TEST_CASE("test bit_io consume too much") {
+		stringstream str;
+
+		{
+			BitOutputStream bo(str);
+			bo.write_bits(0xABCDE, 20);
+		}
+
+		BitInputStream bi(str);
+		CHECK(bi.peek_bits(30) == 0xABCDE);
+		CHECK_THROWS_WITH_AS(bi.consume(30), "no bits left in input: iostream error", istream::failure);
+	}
+
+	TEST_CASE("test bit_io from memory") {
+		mt19937 mtw(43);
+		vector <unsigned char> data(1000);
+		for (unsigned char &c : data) {
+			c = mtw();
+		}
+
+		BitInputStream bi(data);
+		for (size_t i = 0; i + 1 < data.size(); i += 2) {
+			CHECK(bi.read_bits(CHAR_BIT + 3) == (data[i] | (unsigned)(data[i + 1] & 7) << CHAR_BIT));
+			CHECK(bi.read_bits(CHAR_BIT - 3) == (unsigned)(data[i + 1] >> 3));
+		}
+		CHECK(bi.bits_remaining() == 0);
+		CHECK_THROWS_WITH_AS(bi.read_bit(), "no bits left in input: iostream error", istream::failure);
+
+		CHECK_THROWS_AS(BitInputStream(std::span <const unsigned char> ()), istream::failure);
+	}
+
+	TEST_CASE("test bit_io read_bytes") {
+		mt19937 mtw(54);
+		vector <unsigned char> data(200000);
+		for (unsigned char &c : data) {
+			c = mtw();
+		}
+		stringstream str(string(data.begin(), data.end()));
+
+		BitInputStream bi_str(str), bi_mem(data);
+		for (BitInputStream *bi : {&bi_str, &bi_mem}) {
+			size_t pos = 0;
+			while (pos < data.size()) {
+				// bits read before the bytes are left in the bit buffer
+				unsigned bytes = std::min(data.size() - pos, (size_t)mtw() % 4);
+				for (size_t i = 0; i < bytes; i++) {
+					REQUIRE(bi->read_bits(CHAR_BIT) == data[pos++]);
+				}
+				vector <unsigned char> part(std::min(data.size() - pos, (size_t)mtw() % 70000));
+				bi->read_bytes(part);
+				REQUIRE(std::equal(part.begin(), part.end(), data.begin() + pos));
+				pos += part.size();
+			}
+			CHECK(bi->at_end());
+			unsigned char c;
+			CHECK_THROWS_AS(bi->read_bytes(std::span <unsigned char> (&c, 1)), istream::failure);
+		}
+	}
+
+	TEST_CASE("test bit_io to memory") {
+		stringstream str;
+		vector <unsigned char> data(13);
+		{
+			BitOutputStream bo_str(str), bo_mem(data);
+			for (size_t i = 0; i < 20; i++) {
+				bo_str.write_bits(i * 37, 5);
+				bo_mem.write_bits(i * 37, 5);
+			}
+			bo_mem.flush();
+		}
+		CHECK(str.str() == string(data.begin(), data.end()));
+
+		vector <unsigned char> small(12);
+		BitOutputStream bo(small);
+		bo.write_bits(-1, 64);
+		CHECK_THROWS_WITH_AS(bo.write_bits(-1, 64), "no space left in output: iostream error", std::ostream::failure);
+
+		// only an explicit flush tells that the bits left don't fit, the destructor keeps quiet
+		vector <unsigned char> tiny(1);
+		{
+			BitOutputStream bo_tiny(tiny);
+			bo_tiny.write_bits(0xABC, 12);
+			CHECK_THROWS_AS(bo_tiny.flush(), std::ostream::failure);
+		}
+		CHECK(tiny[0] == 0xBC);
+	}
 }
 
 TEST_SUITE("test CharCounter") {
@@ -356,6 +701,70 @@ TEST_SUITE("test CharCounter") {
 			CHECK(cnt.get_char_cnt(i) == 0);
 		}
 	}
+
+	TEST_CASE("test add block") {
+		CharCounter by_char, by_block;
+		mt19937 mtw(41);
+		vector <unsigned char> buf(10007);
+		for (unsigned char &c : buf) {
+			c = mtw() % 7 == 0 ? mtw() : 'z';
+		}
+
+		for (size_t len : {0, 1, 3, 4, 5, 100, 10000}) {
+			for (size_t i = 0; i < len; i++) {
+				by_char.add_char(buf[i]);
+			}
+			by_block.add_block(buf.data(), len);
+		}
+
+		CHECK(by_block.get_total_cnt() == by_char.get_total_cnt());
+		for (size_t i = 0; i < CHARS_CNT; i++) {
+			CHECK(by_block.get_char_cnt(i) == by_char.get_char_cnt(i));
+		}
+	}
+
+	TEST_CASE("test merge") {
+		CharCounter a, b;
+		a.add_char('a');
+		a.add_char('b');
+		b.add_char('b');
+		a.merge(b);
+
+		CHECK(a.get_char_cnt('a') == 1);
+		CHECK(a.get_char_cnt('b') == 2);
+		CHECK(a.get_total_cnt() == 3);
+		CHECK(b.get_total_cnt() == 1);
+	}
+
+	TEST_CASE("test histogram kernels") {
+		mt19937 mtw(42);
+		vector <unsigned char> buf(5000);
+		for (size_t i = 0; i < buf.size(); i++) {
+			buf[i] = (i / 100) % 2 ? mtw() : i / 700;
+		}
+
+		vector <huff_tree::HistogramKernel> kernels{huff_tree::histogram_scalar, huff_tree::get_histogram_kernel()};
+#ifdef HUFF_HISTOGRAM_X86
+		kernels.push_back(huff_tree::histogram_sse2);
+		if (huff_tree::avx2_supported()) {
+			kernels.push_back(huff_tree::histogram_avx2);
+		}
+#endif
+
+		for (size_t len : {0, 1, 15, 16, 17, 31, 32, 33, 1000, 5000}) {
+			vector <size_t> expected(CHARS_CNT);
+			for (size_t i = 0; i < len; i++) {
+				expected[buf[i]]++;
+			}
+			for (huff_tree::HistogramKernel kernel : kernels) {
+				vector <size_t> cnt(CHARS_CNT, 1);
+				kernel(buf.data(), len, cnt.data());
+				for (size_t i = 0; i < CHARS_CNT; i++) {
+					CHECK(cnt[i] == expected[i] + 1);
+				}
+			}
+		}
+	}
 }
 
 TEST_SUITE("test HuffTree") {
@@ -475,6 +884,83 @@ TEST_SUITE("test HuffTree") {
 		CHECK(get_full_length(cnt, t) == 10000);
 	}
 
+	TEST_CASE("test rebuild with equal weights") {
+		HuffTree t;
+		CharCounter cnt;
+		for (size_t i = 0; i < CHARS_CNT; i++) {
+			cnt.add_char((char)i);
+		}
+
+		t.rebuild(cnt);
+		for (size_t i = 0; i < CHARS_CNT; i++) {
+			CHECK(t.get_char_code(i).size() == CHAR_BIT);
+		}
+	}
+
+	// the original builder, which scans the roots for the two lightest ones before every merge
+	vector <unsigned char> get_scan_code_lengths(const CharCounter &cnt, bool present_only) {
+		vector <size_t> weight;
+		vector <vector <unsigned char>> chars;
+		for (size_t i = 0; i < CHARS_CNT; i++) {
+			if (!present_only || cnt.get_char_cnt(i) > 0) {
+				weight.push_back(cnt.get_char_cnt(i));
+				chars.push_back({(unsigned char)i});
+			}
+		}
+
+		vector <unsigned char> code_len(CHARS_CNT);
+		if (weight.size() == 1) {
+			code_len[chars[0][0]] = 1;
+		}
+		while (weight.size() > 1) {
+			size_t first = 0, second = 1;
+			if (weight[0] > weight[1]) {
+				std::swap(first, second);
+			}
+			for (size_t i = 2; i < weight.size(); i++) {
+				if (weight[i] <= weight[first]) {
+					second = first; first = i;
+				} else if (weight[i] < weight[second]) {
+					second = i;
+				}
+			}
+
+			for (size_t v : {first, second}) {
+				for (unsigned char c : chars[v]) {
+					code_len[c]++;
+				}
+			}
+			weight[first] += weight[second];
+			chars[first].insert(chars[first].end(), chars[second].begin(), chars[second].end());
+			std::swap(weight[second], weight.back());
+			std::swap(chars[second], chars.back());
+			weight.pop_back();
+			chars.pop_back();
+		}
+		return code_len;
+	}
+
+	TEST_CASE("test rebuild breaks ties like the original builder") {
+		mt19937 mtw(17);
+		for (size_t iter = 0; iter < 300; iter++) {
+			// few distinct weights, so most of them tie
+			CharCounter cnt;
+			size_t chars_cnt = mtw() % CHARS_CNT + 1, max_cnt = mtw() % 4 + 1;
+			for (size_t i = 0; i < chars_cnt; i++) {
+				unsigned char c = mtw() % CHARS_CNT;
+				for (size_t j = mtw() % max_cnt; j > 0; j--) {
+					cnt.add_char(c);
+				}
+			}
+
+			for (bool present_only : {false, true}) {
+				HuffTree t;
+				t.rebuild(cnt, present_only);
+				CHECK(t.get_code_lengths() == get_scan_code_lengths(cnt, present_only));
+			}
+		}
+	}
+
 	TEST_CASE("test multiple rebuilds") {
 		HuffTree t;
 		CharCounter cnt;
@@ -516,55 +1002,251 @@ TEST_SUITE("test HuffTree") {
 		CHECK(get_full_length(cnt, t) == 79988);
 	}
 
-	TEST_CASE("test tree length") {
+	TEST_CASE("test packed codes") {
 		HuffTree t;
 		CharCounter cnt;
-		mt19937 mtw(22);
-
-		load_chars(cnt, mtw);
-
-		t.rebuild(cnt);
-		CHECK(t.get_compressed_tree().size() == 3068);
+		mt19937 mtw(12);
 
+		load_chars(cnt, mtw, 77);
 		t.rebuild(cnt);
-		CHECK(t.get_compressed_tree().size() == 3068);
 
-		t.rebuild(cnt);
-		CHECK(t.get_compressed_tree().size() == 3068);
+		for (size_t i = 0; i < CHARS_CNT; i++) {
+			const vector <bool> &code = t.get_char_code(i);
+			const huff_tree::PackedCode &pc = t.get_packed_codes()[i];
 
-		t.rebuild(cnt);
-		CHECK(t.get_compressed_tree().size() == 3068);
+			REQUIRE(pc.len == code.size());
+			if (pc.len > huff_tree::PackedCode::MAX_LEN) {
+				continue;
+			}
+			for (size_t j = 0; j < code.size(); j++) {
+				CHECK(((pc.code >> j) & 1) == code[j]);
+			}
+			if (pc.len < huff_tree::PackedCode::MAX_LEN) {
+				CHECK((pc.code >> pc.len) == 0);
+			}
+		}
 	}
 
-	TEST_CASE("test rebuild from file 1") {
+	TEST_CASE("test canonical rebuild") {
 		HuffTree t;
-		mt19937 mtw(28);
+		CharCounter cnt;
+		mt19937 mtw(31);
 
-		vector <unsigned char> p = gen_char_permutation(mtw);
-		vector <bool> tree = gen_random_tree(mtw);
+		load_chars(cnt, mtw, 40);
+		t.rebuild(cnt);
+		size_t full_length = get_full_length(cnt, t);
+		vector <unsigned char> code_len = t.get_code_lengths();
 
-		t.rebuild(p, tree);
-		CHECK(t.get_compressed_tree().size() == 3068);
+		t.rebuild_canonical(code_len);
+		CHECK(t.get_code_lengths() == code_len);
+		CHECK(get_full_length(cnt, t) == full_length);
 
-		t.rebuild(p, tree);
-		CHECK(t.get_compressed_tree().size() == 3068);
+		for (size_t i = 0; i < CHARS_CNT; i++) {
+			for (size_t j = 0; j < CHARS_CNT; j++) {
+				const vector <bool> &a = t.get_char_code(i), &b = t.get_char_code(j);
+				if (a.size() == b.size() && i < j) {
+					CHECK(a < b);
+				}
+			}
+		}
+	}
 
-		t.rebuild(p, tree);
-		CHECK(t.get_compressed_tree().size() == 3068);
+	TEST_CASE("test canonical rebuild from small lengths") {
+		HuffTree t;
+		vector <unsigned char> code_len(CHARS_CNT);
+		code_len['a'] = 1; code_len['b'] = 2; code_len['c'] = 3; code_len['d'] = 3;
 
-		t.rebuild(p, tree);
-		CHECK(t.get_compressed_tree().size() == 3068);
+		t.rebuild_canonical(code_len);
+		CHECK(t.get_char_code('a') == vector <bool> {0});
+		CHECK(t.get_char_code('b') == vector <bool> {1, 0});
+		CHECK(t.get_char_code('c') == vector <bool> {1, 1, 0});
+		CHECK(t.get_char_code('d') == vector <bool> {1, 1, 1});
+		CHECK(t.get_char_code('e').empty());
 	}
 
-	TEST_CASE("test rebuild from file 2") {
+	TEST_CASE("test canonical rebuild of a lone char") {
 		HuffTree t;
-		mt19937 mtw(11);
-
-		vector <unsigned char> p = gen_char_permutation(mtw);
-		vector <bool> tree = gen_random_tree(mtw);
+		vector <unsigned char> code_len(CHARS_CNT);
+		t.rebuild_canonical(code_len);
+		CHECK(t.get_code_lengths() == code_len);
 
-		t.rebuild(p, tree);
-		CHECK(t.get_compressed_tree().size() == 3068);
+		code_len['z'] = 1;
+		t.rebuild_canonical(code_len);
+		CHECK(t.get_char_code('z') == vector <bool> {0});
+	}
+
+	TEST_CASE("test rebuild over present chars") {
+		HuffTree t;
+		CharCounter cnt;
+		mt19937 mtw(33);
+
+		load_chars(cnt, mtw, 20);
+		t.rebuild(cnt);
+		size_t full_length = get_full_length(cnt, t);
+
+		t.rebuild(cnt, true);
+		CHECK(get_full_length(cnt, t) <= full_length);
+		for (size_t i = 0; i < CHARS_CNT; i++) {
+			CHECK(t.get_char_code(i).empty() == (cnt.get_char_cnt(i) == 0));
+		}
+	}
+
+	TEST_CASE("test rebuild over one present char") {
+		HuffTree t;
+		CharCounter cnt;
+		cnt.add_char('q'); cnt.add_char('q');
+
+		t.rebuild(cnt, true);
+		CHECK(t.get_char_code('q') == vector <bool> {0});
+		CHECK(get_full_length(cnt, t) == 2);
+
+		t.rebuild(CharCounter(), true);
+		CHECK(get_full_length(cnt, t) == 0);
+	}
+
+	TEST_CASE("test length-limited rebuild") {
+		HuffTree t;
+		CharCounter cnt;
+		for (size_t i = 0, a = 1, b = 1; i < 30; i++, b += a, a = b - a) {
+			for (size_t j = 0; j < a; j++) {
+				cnt.add_char('a' + i);
+			}
+		}
+
+		t.rebuild(cnt, true);
+		size_t unlimited = get_full_length(cnt, t);
+		CHECK(t.get_char_code('a').size() == 29);
+
+		for (size_t limit : {5, 11, 15, 28}) {
+			t.rebuild(cnt, true, limit);
+			vector <unsigned char> code_len = t.get_code_lengths();
+			double kraft = 0;
+			for (size_t i = 0; i < CHARS_CNT; i++) {
+				CHECK(code_len[i] <= limit);
+				CHECK((code_len[i] > 0) == (cnt.get_char_cnt(i) > 0));
+				if (code_len[i] > 0) {
+					kraft += 1.0 / (1ull << code_len[i]);
+				}
+			}
+			CHECK(kraft == 1.0);
+			CHECK(get_full_length(cnt, t) >= unlimited);
+		}
+
+		t.rebuild(cnt, true, 29);
+		CHECK(get_full_length(cnt, t) == unlimited);
+		CHECK_THROWS_AS(t.rebuild(cnt, true, 4), invalid_argument);
+
+		t.rebuild(cnt, false, 8);
+		for (size_t i = 0; i < CHARS_CNT; i++) {
+			CHECK(t.get_char_code(i).size() <= 8);
+		}
+		CHECK_THROWS_AS(t.rebuild(cnt, false, 7), invalid_argument);
+	}
+
+	TEST_CASE("test length-limited rebuild is optimal") {
+		HuffTree t;
+		CharCounter cnt;
+		for (size_t i = 0; i < 8; i++) cnt.add_char('a');
+		for (size_t i = 0; i < 4; i++) cnt.add_char('b');
+		for (size_t i = 0; i < 2; i++) cnt.add_char('c');
+		cnt.add_char('d');
+		cnt.add_char('e');
+
+		t.rebuild(cnt, true, 3);
+		CHECK(get_full_length(cnt, t) == 8 * 1 + 4 * 3 + 2 * 3 + 1 * 3 + 1 * 3);
+
+		t.rebuild(cnt, true, 4);
+		CHECK(get_full_length(cnt, t) == 8 * 1 + 4 * 2 + 2 * 3 + 1 * 4 + 1 * 4);
+	}
+
+	TEST_CASE("test canonical rebuild failures") {
+		HuffTree t;
+		vector <unsigned char> code_len(CHARS_CNT);
+		code_len['a'] = 2;
+		CHECK_THROWS_WITH_AS(t.rebuild_canonical(code_len), "code lengths are incomplete", invalid_file_format);
+
+		code_len['a'] = 1; code_len['b'] = 2;
+		CHECK_THROWS_WITH_AS(t.rebuild_canonical(code_len), "code lengths are incomplete", invalid_file_format);
+
+		code_len['c'] = 2; code_len['d'] = 2;
+		CHECK_THROWS_WITH_AS(t.rebuild_canonical(code_len), "code lengths are over-subscribed", invalid_file_format);
+
+		code_len.pop_back();
+		CHECK_THROWS_WITH_AS(t.rebuild_canonical(code_len), "wrong number of code lengths", invalid_file_format);
+	}
+
+	TEST_CASE("test rebuilds don't allocate") {
+		HuffTree t;
+		CharCounter cnt;
+		mt19937 mtw(35);
+
+		load_chars(cnt, mtw, 50);
+		vector <unsigned char> p = gen_char_permutation(mtw);
+		vector <bool> tree = gen_random_tree(mtw);
+		t.rebuild(cnt, true);
+		vector <unsigned char> code_len = t.get_code_lengths();
+
+		for (size_t it = 0; it < 2; it++) {
+			size_t before = allocations_cnt;
+			t.rebuild(cnt);
+			t.rebuild(cnt, true);
+			t.rebuild_canonical(code_len);
+			t.rebuild(p, tree);
+			if (it > 0) {
+				CHECK(allocations_cnt == before);
+			}
+		}
+	}
+
+	TEST_CASE("test tree length") {
+		HuffTree t;
+		CharCounter cnt;
+		mt19937 mtw(22);
+
+		load_chars(cnt, mtw);
+
+		t.rebuild(cnt);
+		CHECK(t.get_compressed_tree().size() == 3068);
+
+		t.rebuild(cnt);
+		CHECK(t.get_compressed_tree().size() == 3068);
+
+		t.rebuild(cnt);
+		CHECK(t.get_compressed_tree().size() == 3068);
+
+		t.rebuild(cnt);
+		CHECK(t.get_compressed_tree().size() == 3068);
+	}
+
+	TEST_CASE("test rebuild from file 1") {
+		HuffTree t;
+		mt19937 mtw(28);
+
+		vector <unsigned char> p = gen_char_permutation(mtw);
+		vector <bool> tree = gen_random_tree(mtw);
+
+		t.rebuild(p, tree);
+		CHECK(t.get_compressed_tree().size() == 3068);
+
+		t.rebuild(p, tree);
+		CHECK(t.get_compressed_tree().size() == 3068);
+
+		t.rebuild(p, tree);
+		CHECK(t.get_compressed_tree().size() == 3068);
+
+		t.rebuild(p, tree);
+		CHECK(t.get_compressed_tree().size() == 3068);
+	}
+
+	TEST_CASE("test rebuild from file 2") {
+		HuffTree t;
+		mt19937 mtw(11);
+
+		vector <unsigned char> p = gen_char_permutation(mtw);
+		vector <bool> tree = gen_random_tree(mtw);
+
+		t.rebuild(p, tree);
+		CHECK(t.get_compressed_tree().size() == 3068);
 
 		t.rebuild(p, tree);
 		CHECK(t.get_compressed_tree().size() == 3068);
@@ -672,6 +1354,233 @@ TEST_SUITE("test HuffTree") {
 	}
 }
 
+TEST_SUITE("test AdaptiveHuffTree") {
+	TEST_CASE("test adaptive codes") {
+		mt19937 mtw(50);
+		string s;
+		for (size_t i = 0; i < 50000; i++) {
+			s.push_back(i < 25000 ? 'a' + std::countr_zero((unsigned)mtw() | (1u << 20)) : mtw() % 256);
+		}
+
+		stringstream str;
+		size_t bits = 0;
+		{
+			AdaptiveHuffTree t;
+			BitOutputStream bo(str);
+			for (char c : s) {
+				bits += t.encode((unsigned char)c, bo);
+			}
+			bits += t.encode(AdaptiveHuffTree::END, bo);
+		}
+		string code = str.str();
+		CHECK(code.size() == (bits + CHAR_BIT - 1) / CHAR_BIT);
+		// the skewed half takes a few bits per char
+		CHECK(code.size() < s.size() * 3 / 4);
+
+		AdaptiveHuffTree t;
+		BitInputStream bi(str);
+		string res;
+		size_t len = 0, res_bits = 0;
+		for (size_t symbol; (symbol = t.decode(bi, len)) != AdaptiveHuffTree::END; res_bits += len) {
+			res.push_back(symbol);
+		}
+		CHECK(res == s);
+		CHECK(res_bits + len == bits);
+
+		// a code cut by the end of data is left for later
+		std::span <const unsigned char> data((const unsigned char*)code.data(), code.size());
+		t.reset();
+		res.clear();
+		size_t pos = 0, symbol = 0;
+		for (size_t end = 1; end <= data.size(); end += 7) {
+			while (t.decode(data.first(end), pos, symbol) && symbol != AdaptiveHuffTree::END) {
+				res.push_back(symbol);
+			}
+		}
+		while (t.decode(data, pos, symbol) && symbol != AdaptiveHuffTree::END) {
+			res.push_back(symbol);
+		}
+		CHECK(res == s);
+		CHECK(pos == bits);
+	}
+
+	TEST_CASE("test adaptive escape of a known char") {
+		stringstream str;
+		{
+			AdaptiveHuffTree t;
+			BitOutputStream bo(str);
+			t.encode('a', bo);
+			// the code of NYT is 0 now, and 'a' can't be escaped again
+			bo.write_bit(0);
+			bo.write_bits('a', AdaptiveHuffTree::SYMBOL_BITS);
+		}
+		AdaptiveHuffTree t;
+		BitInputStream bi(str);
+		size_t len;
+		CHECK(t.decode(bi, len) == 'a');
+		CHECK_THROWS_AS(t.decode(bi, len), invalid_file_format);
+	}
+}
+
+TEST_SUITE("test HuffDecoder") {
+	string encode(const HuffTree &t, const string &s, size_t &bits) {
+		stringstream str;
+		bits = 0;
+		{
+			BitOutputStream bo(str);
+			for (char c : s) {
+				for (bool b : t.get_char_code((unsigned char)c)) {
+					bo.write_bit(b);
+					bits++;
+				}
+			}
+		}
+		return str.str();
+	}
+
+	void check_decode(const HuffTree &t, const string &s) {
+		size_t bits;
+		stringstream arch(encode(t, s + "#", bits)), res;
+
+		HuffDecoder d;
+		d.rebuild(t);
+		BitInputStream bi(arch);
+		CHECK(d.decode(bi, bits, res) == s.size() + 1);
+		CHECK(res.str() == s + "#");
+	}
+
+	TEST_CASE("test short codes") {
+		mt19937 mtw(3);
+		CharCounter cnt;
+		string s;
+		for (size_t i = 0; i < 10000; i++) {
+			s.push_back('a' + mtw() % 26);
+			cnt.add_char(s.back());
+		}
+		cnt.add_char('#');
+
+		HuffTree t;
+		t.rebuild(cnt);
+		check_decode(t, s);
+	}
+
+	TEST_CASE("test long codes") {
+		mt19937 mtw(5);
+		CharCounter cnt;
+		for (size_t i = 0; i < 40; i++) {
+			for (size_t j = 0; j < ((size_t)1 << (i / 2)); j++) {
+				cnt.add_char((char)i);
+			}
+		}
+		cnt.add_char('#');
+
+		HuffTree t;
+		t.rebuild(cnt);
+		CHECK(t.get_char_code(0).size() > HuffDecoder::TABLE_BITS);
+
+		string s;
+		for (size_t i = 0; i < 10000; i++) {
+			s.push_back((char)(mtw() % 40));
+		}
+		check_decode(t, s);
+	}
+
+	TEST_CASE("test multi-char table") {
+		mt19937 mtw(8);
+		CharCounter cnt;
+		string s;
+		for (size_t i = 0; i < 20000; i++) {
+			size_t r = mtw() % 16;
+			s.push_back(r < 8 ? 'a' : r < 12 ? 'b' : r < 15 ? 'c' : 'd' + mtw() % 20);
+			cnt.add_char(s.back());
+		}
+		cnt.add_char('#');
+
+		HuffTree t;
+		t.rebuild(cnt);
+
+		HuffDecoder d;
+		d.rebuild(t);
+		CHECK(d.uses_multi_table());
+
+		check_decode(t, s);
+	}
+
+	TEST_CASE("test no multi-char table for flat distribution") {
+		CharCounter cnt;
+		for (size_t i = 0; i < CHARS_CNT; i++) {
+			cnt.add_char((char)i);
+		}
+
+		HuffTree t;
+		t.rebuild(cnt);
+
+		HuffDecoder d;
+		d.rebuild(t);
+		CHECK(!d.uses_multi_table());
+	}
+
+	TEST_CASE("test code cut by declared size") {
+		HuffTree t;
+		CharCounter cnt;
+		for (char c : string("aaaaaaaaaabbbbbcc")) {
+			cnt.add_char(c);
+		}
+		t.rebuild(cnt);
+
+		size_t bits;
+		stringstream arch(encode(t, "cc", bits)), res;
+
+		HuffDecoder d;
+		d.rebuild(t);
+		BitInputStream bi(arch);
+		CHECK_THROWS_WITH_AS(d.decode(bi, bits - 1, res), "unhandled chars at the end of file", invalid_file_format);
+	}
+
+	TEST_CASE("test interleaved streams with long codes") {
+		// codes of 1 to 28 bits, so that a long code stops the turns now and then
+		const size_t max_len = 28;
+		vector <unsigned char> code_len(CHARS_CNT);
+		for (size_t i = 0; i < max_len; i++) {
+			code_len[i] = i + 1;
+		}
+		code_len[max_len] = max_len;
+		HuffTree t;
+		t.rebuild_canonical(code_len);
+		HuffDecoder d;
+		d.rebuild(t);
+
+		mt19937 mtw(29);
+		for (size_t iter = 0; iter < 1000; iter++) {
+			const size_t streams_cnt = HuffDecoder::FAST_STREAMS_CNT;
+			vector <string> src(streams_cnt), code(streams_cnt);
+			vector <size_t> bits(streams_cnt);
+			for (size_t k = 0; k < streams_cnt; k++) {
+				size_t len = mtw() % 300;
+				for (size_t i = 0; i < len; i++) {
+					src[k].push_back((char)(mtw() % (max_len + 1)));
+				}
+				code[k] = encode(t, src[k], bits[k]);
+			}
+
+			// the outputs follow each other in one buffer, as the segments of a block do
+			string all;
+			for (const string &x : src) {
+				all += x;
+			}
+			vector <unsigned char> res(all.size());
+			vector <std::span <const unsigned char>> in;
+			vector <std::span <unsigned char>> out;
+			for (size_t k = 0, pos = 0; k < streams_cnt; pos += src[k].size(), k++) {
+				in.emplace_back((const unsigned char*)code[k].data(), code[k].size());
+				out.emplace_back(res.data() + pos, src[k].size());
+			}
+			d.decode_interleaved(in, bits, out);
+			CHECK(string(res.begin(), res.end()) == all);
+		}
+	}
+}
+
 TEST_SUITE("test HuffmanArchiver and HuffmanDearchiver") {
 	const size_t TREE_SZ = CHARS_CNT * 2 - 1;
 
@@ -1059,6 +1968,826 @@ TEST_SUITE("test HuffmanArchiver and HuffmanDearchiver") {
 		CHECK(src.str() == res.str());
 	}
 
+	HuffFileData check_round_trip(const string &s, ArchiveFormat format, size_t max_code_len = 0) {
+		stringstream src(s), arch, res;
+
+		HuffmanArchiver a;
+		a.set_format(format);
+		a.set_max_code_len(max_code_len);
+		HuffFileData x = a.archive(src, arch);
+
+		HuffmanDearchiver d;
+		HuffFileData y = d.dearchive(arch, res);
+
+		CHECK(res.str() == s);
+		CHECK(s.size() == x.input_sz);
+		CHECK(arch.str().size() == x.output_sz + x.additional_sz);
+		CHECK(x.input_sz == y.output_sz);
+		CHECK(x.output_sz == y.input_sz);
+		CHECK(x.additional_sz == y.additional_sz);
+
+		std::span <const unsigned char> src_data((const unsigned char*)s.data(), s.size());
+		stringstream arch_from_memory, res_from_memory;
+		HuffFileData x_from_memory = a.archive(src_data, arch_from_memory);
+		CHECK(arch_from_memory.str() == arch.str());
+		CHECK(x_from_memory.output_sz == x.output_sz);
+		CHECK(x_from_memory.additional_sz == x.additional_sz);
+
+		string arch_str = arch.str();
+		std::span <const unsigned char> arch_data((const unsigned char*)arch_str.data(), arch_str.size());
+		HuffFileData y_from_memory = d.dearchive(arch_data, res_from_memory);
+		CHECK(res_from_memory.str() == s);
+		CHECK(y_from_memory.input_sz == y.input_sz);
+		CHECK(y_from_memory.additional_sz == y.additional_sz);
+
+		vector <unsigned char> arch_mem;
+		HuffFileData x_to_memory = a.archive(src_data, [&arch_mem](size_t sz) {
+			arch_mem.resize(sz);
+			return std::span <unsigned char> (arch_mem);
+		});
+		CHECK(string(arch_mem.begin(), arch_mem.end()) == arch_str);
+		CHECK(x_to_memory.output_sz == x.output_sz);
+
+		vector <unsigned char> res_mem;
+		HuffFileData y_to_memory = d.dearchive(arch_data, [&res_mem](size_t sz) {
+			res_mem.resize(sz);
+			return std::span <unsigned char> (res_mem);
+		});
+		CHECK(y_to_memory.output_sz == s.size());
+		CHECK(res_mem.size() >= s.size());
+		if (format != ArchiveFormat::LEGACY) {
+			CHECK(res_mem.size() == s.size());
+		}
+		CHECK(string(res_mem.begin(), res_mem.begin() + s.size()) == s);
+		return x;
+	}
+
+	TEST_CASE("test canonical archive/dearchive") {
+		mt19937 mtw(40);
+		check_round_trip("Hello, World!", ArchiveFormat::CANONICAL);
+		check_round_trip("kek", ArchiveFormat::CANONICAL);
+		check_round_trip("", ArchiveFormat::CANONICAL);
+		check_round_trip("a", ArchiveFormat::CANONICAL);
+		check_round_trip(string(5555, (char)24), ArchiveFormat::CANONICAL);
+
+		for (size_t mod : {1, 2, 10, 100, 256}) {
+			string s;
+			for (size_t i = 0; i < 5000; i++) {
+				s.push_back(mtw() % mod);
+			}
+			check_round_trip(s, ArchiveFormat::CANONICAL);
+		}
+	}
+
+	TEST_CASE("test adaptive archive/dearchive") {
+		mt19937 mtw(51);
+		check_round_trip("", ArchiveFormat::ADAPTIVE);
+		check_round_trip("a", ArchiveFormat::ADAPTIVE);
+		check_round_trip("Hello, World!", ArchiveFormat::ADAPTIVE);
+		for (size_t i = 0; i < 10; i++) {
+			string s;
+			size_t sz = mtw() % 10000;
+			for (size_t j = 0; j < sz; j++) {
+				s.push_back(mtw() % (1 + i * 25));
+			}
+			check_round_trip(s, ArchiveFormat::ADAPTIVE);
+		}
+
+		// memory is asked for exactly, more of it is left alone and less of it is an error when archiving
+		HuffmanArchiver a;
+		a.set_format(ArchiveFormat::ADAPTIVE);
+		HuffmanDearchiver d;
+		string text = "Hello, World!";
+		std::span <const unsigned char> text_data((const unsigned char*)text.data(), text.size());
+		vector <unsigned char> arch_mem, res_mem;
+		HuffFileData x = a.archive(text_data, [&arch_mem](size_t sz) {
+			arch_mem.assign(sz + 100, 0xAA);
+			return std::span <unsigned char> (arch_mem);
+		});
+		CHECK(arch_mem.size() == x.output_sz + x.additional_sz + 100);
+		CHECK(std::all_of(arch_mem.end() - 100, arch_mem.end(), [](unsigned char c) { return c == 0xAA; }));
+		arch_mem.resize(arch_mem.size() - 100);
+		d.dearchive(arch_mem, [&res_mem](size_t sz) {
+			res_mem.resize(sz);
+			return std::span <unsigned char> (res_mem);
+		});
+		CHECK(string(res_mem.begin(), res_mem.end()) == text);
+		CHECK_THROWS_AS(a.archive(text_data, [&res_mem](size_t sz) {
+			res_mem.resize(sz - 1);
+			return std::span <unsigned char> (res_mem);
+		}), std::ostream::failure);
+
+		stringstream arch, res;
+		arch << "HUFF" << (char)ArchiveFormat::ADAPTIVE << "x";
+		CHECK_THROWS_WITH_AS(d.dearchive(arch, res), "too few bits in input file", invalid_file_format);
+	}
+
+	TEST_CASE("test adaptive archive of a slow stream") {
+		// hands out the input a line at a time and notes how much of the archive is written by then
+		struct SlowBuf : std::streambuf {
+			string lines;
+			size_t pos = 0;
+			const stringstream *arch;
+			vector <size_t> arch_sz;
+
+			int underflow() override {
+				if (pos == lines.size()) {
+					return traits_type::eof();
+				}
+				arch_sz.push_back(arch->str().size());
+				size_t end = lines.find('\n', pos) + 1;
+				setg(lines.data() + pos, lines.data() + pos, lines.data() + end);
+				pos = end;
+				return traits_type::to_int_type(*gptr());
+			}
+		};
+
+		SlowBuf buf;
+		for (size_t i = 0; i < 100; i++) {
+			buf.lines += "log line " + std::to_string(i) + "\n";
+		}
+		stringstream arch;
+		buf.arch = &arch;
+		istream src(&buf);
+
+		HuffmanArchiver a;
+		a.set_format(ArchiveFormat::ADAPTIVE);
+		a.archive(src, arch);
+		// every line is passed on before the next one is read, except for the bits of a partial byte
+		CHECK(buf.arch_sz.size() == 100);
+		CHECK(buf.arch_sz[0] == huffman::ARCHIVE_MAGIC_SZ + 1);
+		for (size_t i = 1; i < buf.arch_sz.size(); i++) {
+			CHECK(buf.arch_sz[i] > buf.arch_sz[i - 1]);
+		}
+
+		stringstream res;
+		HuffmanDearchiver d;
+		d.dearchive(arch, res);
+		CHECK(res.str() == buf.lines);
+	}
+
+	TEST_CASE("test periodic archive/dearchive") {
+		mt19937 mtw(52);
+		check_round_trip("", ArchiveFormat::PERIODIC);
+		check_round_trip("a", ArchiveFormat::PERIODIC);
+		check_round_trip("Hello, World!", ArchiveFormat::PERIODIC);
+		for (size_t i = 0; i < 10; i++) {
+			string s;
+			size_t sz = mtw() % 50000;
+			for (size_t j = 0; j < sz; j++) {
+				s.push_back(mtw() % (1 + i * 25));
+			}
+			check_round_trip(s, ArchiveFormat::PERIODIC);
+			check_round_trip(s, ArchiveFormat::PERIODIC, CHAR_BIT);
+		}
+
+		HuffmanArchiver a;
+		a.set_format(ArchiveFormat::PERIODIC);
+		CHECK_THROWS_AS(a.set_window_sz(0), invalid_argument);
+		a.set_max_code_len(CHAR_BIT - 1);
+		stringstream src("Hello, World!"), arch;
+		CHECK_THROWS_AS(a.archive(src, arch), invalid_argument);
+
+		stringstream bad_arch, res;
+		bad_arch << "HUFF" << (char)ArchiveFormat::PERIODIC << (char)(CHAR_BIT - 1);
+		HuffmanDearchiver d;
+		CHECK_THROWS_WITH_AS(d.dearchive(bad_arch, res), "wrong code length limit in archive", invalid_file_format);
+	}
+
+	TEST_CASE("test periodic archive adapts to the input") {
+		// text and then binary data, like in a pdf
+		mt19937 mtw(53);
+		string s;
+		for (size_t i = 0; i < 200000; i++) {
+			s.push_back(i < 100000 ? 'a' + std::countr_zero((unsigned)mtw() | (1u << 10)) : mtw() % 256);
+		}
+		HuffFileData canonical = check_round_trip(s, ArchiveFormat::CANONICAL);
+		HuffFileData periodic = check_round_trip(s, ArchiveFormat::PERIODIC);
+		CHECK(periodic.output_sz + periodic.additional_sz < canonical.output_sz + canonical.additional_sz);
+
+		for (size_t window_sz : {1, 1000, 1 << 20}) {
+			HuffmanArchiver a;
+			a.set_format(ArchiveFormat::PERIODIC);
+			a.set_window_sz(window_sz);
+			stringstream src(s.substr(0, 5000)), arch, res;
+			HuffFileData x = a.archive(src, arch);
+			// no tree is stored, a window of a char has a byte for its size and one for its code size
+			if (window_sz == 1) {
+				CHECK(x.additional_sz == huffman::ARCHIVE_MAGIC_SZ + 3 + 5000 * 2);
+			}
+			HuffmanDearchiver d;
+			d.dearchive(arch, res);
+			CHECK(res.str() == s.substr(0, 5000));
+		}
+	}
+
+	TEST_CASE("test bad periodic archives") {
+		HuffmanArchiver a;
+		a.set_format(ArchiveFormat::PERIODIC);
+		a.set_window_sz(100);
+		stringstream src(string(1000, 'x') + "Hello, World!"), arch;
+		a.archive(src, arch);
+		string s = arch.str();
+
+		for (size_t cut = 1; cut < s.size(); cut += 7) {
+			string bad = s.substr(0, s.size() - cut);
+			stringstream in(bad), res;
+			HuffmanDearchiver d;
+			CHECK_THROWS_AS(d.dearchive(in, res), invalid_file_format);
+
+			vector <unsigned char> res_mem;
+			CHECK_THROWS_AS(d.dearchive(std::span <const unsigned char> ((const unsigned char*)bad.data(), bad.size()), [&res_mem](size_t sz) {
+				res_mem.resize(sz);
+				return std::span <unsigned char> (res_mem);
+			}), invalid_file_format);
+		}
+	}
+
+	TEST_CASE("test length-limited archive/dearchive") {
+		string s;
+		for (size_t i = 0, a = 1, b = 1; i < 25; i++, b += a, a = b - a) {
+			s += string(a, 'A' + i);
+		}
+		HuffFileData unlimited = check_round_trip(s, ArchiveFormat::CANONICAL);
+
+		for (ArchiveFormat format : {ArchiveFormat::LEGACY, ArchiveFormat::CANONICAL}) {
+			for (size_t limit : {8, 11, 12, 15}) {
+				HuffFileData x = check_round_trip(s, format, limit);
+				CHECK(x.output_sz >= unlimited.output_sz);
+			}
+		}
+
+		HuffmanArchiver a;
+		CHECK_THROWS_AS(a.set_max_code_len(256), invalid_argument);
+		a.set_max_code_len(7);
+		stringstream src(s), arch;
+		CHECK_THROWS_AS(a.archive(src, arch), invalid_argument);
+	}
+
+	TEST_CASE("test compress/decompress buffers") {
+		mt19937 mtw(44);
+		for (ArchiveFormat format : {ArchiveFormat::LEGACY, ArchiveFormat::CANONICAL}) {
+			for (size_t mod : {1, 2, 10, 256}) {
+				for (size_t sz : {0, 1, 100, 5000}) {
+					vector <std::byte> src(sz);
+					for (std::byte &b : src) {
+						b = (std::byte)(mtw() % mod);
+					}
+
+					vector <std::byte> arch, res;
+					HuffFileData x = huffman::compress(src, arch, format);
+					CHECK(arch.size() == x.output_sz + x.additional_sz);
+					CHECK(arch.size() <= huffman::compress_bound(sz));
+
+					HuffFileData y = huffman::decompress(arch, res);
+					CHECK(res == src);
+					CHECK(y.output_sz == sz);
+				}
+			}
+		}
+
+		vector <std::byte> res;
+		CHECK_THROWS_AS(huffman::decompress(vector <std::byte> (), res), invalid_file_format);
+	}
+
+	TEST_CASE("test compress bound") {
+		vector <std::byte> src, arch;
+		for (size_t i = 0; i < CHARS_CNT * 8; i++) {
+			src.push_back((std::byte)(i % CHARS_CNT));
+		}
+		for (ArchiveFormat format : {ArchiveFormat::LEGACY, ArchiveFormat::CANONICAL, ArchiveFormat::BLOCKS, ArchiveFormat::INTERLEAVED}) {
+			huffman::compress(src, arch, format);
+			CHECK(arch.size() <= huffman::compress_bound(src.size()));
+			huffman::compress(src, arch, format, 8);
+			CHECK(arch.size() <= huffman::compress_bound(src.size()));
+		}
+	}
+
+	TEST_CASE("test blocks archive/dearchive") {
+		mt19937 mtw(45);
+		check_round_trip("", ArchiveFormat::BLOCKS);
+		check_round_trip("a", ArchiveFormat::BLOCKS);
+		check_round_trip("Hello, World!", ArchiveFormat::BLOCKS);
+
+		string s;
+		for (size_t i = 0; i < 10000; i++) {
+			s.push_back(i < 5000 ? 'a' + mtw() % 3 : mtw() % 256);
+		}
+		std::span <const unsigned char> src_data((const unsigned char*)s.data(), s.size());
+
+		string expected;
+		for (size_t block_sz : {1, 7, 1000, 4096, 20000}) {
+			for (size_t threads_cnt : {1, 4}) {
+				HuffmanArchiver a;
+				a.set_format(ArchiveFormat::BLOCKS);
+				a.set_block_sz(block_sz);
+				a.set_threads_cnt(threads_cnt);
+
+				stringstream src(s), arch, arch_from_memory;
+				HuffFileData x = a.archive(src, arch);
+				a.archive(src_data, arch_from_memory);
+				vector <unsigned char> arch_mem;
+				a.archive(src_data, [&arch_mem](size_t sz) {
+					arch_mem.resize(sz);
+					return std::span <unsigned char> (arch_mem);
+				});
+				CHECK(arch_from_memory.str() == arch.str());
+				CHECK(string(arch_mem.begin(), arch_mem.end()) == arch.str());
+				CHECK(arch.str().size() == x.output_sz + x.additional_sz);
+				if (threads_cnt == 1) {
+					expected = arch.str();
+				}
+				CHECK(arch.str() == expected);
+
+				HuffmanDearchiver d;
+				d.set_threads_cnt(threads_cnt);
+				stringstream res, res_from_memory;
+				HuffFileData y = d.dearchive(arch, res);
+				CHECK(res.str() == s);
+				CHECK(x.output_sz == y.input_sz);
+				CHECK(x.additional_sz == y.additional_sz);
+
+				y = d.dearchive(std::span <const unsigned char> (arch_mem), res_from_memory);
+				CHECK(res_from_memory.str() == s);
+				CHECK(x.output_sz == y.input_sz);
+				CHECK(x.additional_sz == y.additional_sz);
+
+				vector <unsigned char> res_mem;
+				HuffFileData z = d.dearchive(std::span <const unsigned char> (arch_mem), [&res_mem](size_t sz) {
+					res_mem.resize(sz);
+					return std::span <unsigned char> (res_mem);
+				});
+				CHECK(string(res_mem.begin(), res_mem.end()) == s);
+				CHECK(x.output_sz == z.input_sz);
+				CHECK(x.additional_sz == z.additional_sz);
+			}
+		}
+
+		HuffmanArchiver a;
+		CHECK_THROWS_AS(a.set_block_sz(0), invalid_argument);
+	}
+
+	TEST_CASE("test bad blocks archives") {
+		HuffmanArchiver a;
+		a.set_format(ArchiveFormat::BLOCKS);
+		a.set_block_sz(100);
+		stringstream src(string(1000, 'x') + "Hello, World!"), arch;
+		a.archive(src, arch);
+		string s = arch.str();
+
+		for (size_t cut = 1; cut < s.size(); cut += 7) {
+			string bad = s.substr(0, s.size() - cut);
+			stringstream in(bad), res;
+			HuffmanDearchiver d;
+			CHECK_THROWS_AS(d.dearchive(in, res), invalid_file_format);
+
+			vector <unsigned char> res_mem;
+			CHECK_THROWS_AS(d.dearchive(std::span <const unsigned char> ((const unsigned char*)bad.data(), bad.size()), [&res_mem](size_t sz) {
+				res_mem.resize(sz);
+				return std::span <unsigned char> (res_mem);
+			}), invalid_file_format);
+		}
+	}
+
+	TEST_CASE("test interleaved archive/dearchive") {
+		check_round_trip("", ArchiveFormat::INTERLEAVED);
+		check_round_trip("ab", ArchiveFormat::INTERLEAVED);
+
+		// the first half has codes too long for the decoding tables, the second one short codes
+		mt19937 mtw(47);
+		string s;
+		for (size_t i = 0; i < 12000; i++) {
+			size_t x = mtw() % (1 << 20);
+			s.push_back(i < 6000 ? std::countr_zero(x | (1 << 19)) : 'a' + x % 5);
+		}
+
+		for (size_t streams_cnt : {1, 2, 3, 4, 5, 16}) {
+			for (size_t block_sz : {1, 7, 1000, 10000}) {
+				// tiny blocks only on a part of the text where the two halves meet
+				const string text = block_sz < 100 ? s.substr(5850, 300) : s;
+				HuffmanArchiver a;
+				a.set_format(ArchiveFormat::INTERLEAVED);
+				a.set_block_sz(block_sz);
+				a.set_streams_cnt(streams_cnt);
+
+				stringstream src(text), arch;
+				HuffFileData x = a.archive(src, arch);
+				string arch_str = arch.str();
+				CHECK(arch_str.size() == x.output_sz + x.additional_sz);
+
+				HuffmanDearchiver d;
+				stringstream res;
+				HuffFileData y = d.dearchive(arch, res);
+				CHECK(res.str() == text);
+				CHECK(x.output_sz == y.input_sz);
+				CHECK(x.additional_sz == y.additional_sz);
+
+				vector <unsigned char> res_mem;
+				HuffFileData z = d.dearchive(std::span <const unsigned char> ((const unsigned char*)arch_str.data(), arch_str.size()), [&res_mem](size_t sz) {
+					res_mem.resize(sz);
+					return std::span <unsigned char> (res_mem);
+				});
+				CHECK(string(res_mem.begin(), res_mem.end()) == text);
+				CHECK(x.output_sz == z.input_sz);
+				CHECK(x.additional_sz == z.additional_sz);
+			}
+		}
+
+		HuffmanArchiver a;
+		CHECK_THROWS_AS(a.set_streams_cnt(0), invalid_argument);
+		CHECK_THROWS_AS(a.set_streams_cnt(256), invalid_argument);
+	}
+
+	TEST_CASE("test bad interleaved archives") {
+		HuffmanArchiver a;
+		a.set_format(ArchiveFormat::INTERLEAVED);
+		a.set_block_sz(100);
+		stringstream src(string(1000, 'x') + "Hello, World!"), arch;
+		a.archive(src, arch);
+		string s = arch.str();
+
+		auto check_bad = [](const string &bad) {
+			stringstream in(bad), res;
+			HuffmanDearchiver d;
+			CHECK_THROWS_AS(d.dearchive(in, res), invalid_file_format);
+
+			vector <unsigned char> res_mem;
+			CHECK_THROWS_AS(d.dearchive(std::span <const unsigned char> ((const unsigned char*)bad.data(), bad.size()), [&res_mem](size_t sz) {
+				res_mem.resize(sz);
+				return std::span <unsigned char> (res_mem);
+			}), invalid_file_format);
+		};
+		for (size_t cut = 1; cut < s.size(); cut += 7) {
+			check_bad(s.substr(0, s.size() - cut));
+		}
+
+		// the first block is 100 chars of one kind, the number of its streams follows its code lengths
+		const size_t streams_cnt_pos = huffman::ARCHIVE_MAGIC_SZ + 1 + 1 + 4;
+		REQUIRE(s[streams_cnt_pos] == 4);
+		for (char streams_cnt : {0, 3, 5}) {
+			string bad = s;
+			bad[streams_cnt_pos] = streams_cnt;
+			check_bad(bad);
+		}
+	}
+
+	TEST_CASE("test parallel counting and encoding") {
+		mt19937 mtw(46);
+		string s;
+		for (size_t i = 0; i < (5 << 20) + 7; i++) {
+			s.push_back(i % 3 ? 'a' + mtw() % 26 : mtw() % 7);
+		}
+		std::span <const unsigned char> src_data((const unsigned char*)s.data(), s.size());
+
+		for (ArchiveFormat format : {ArchiveFormat::LEGACY, ArchiveFormat::CANONICAL}) {
+			stringstream src(s), expected;
+			HuffmanArchiver a;
+			a.set_format(format);
+			HuffFileData x = a.archive(src, expected);
+
+			for (size_t threads_cnt : {1, 2, 4}) {
+				stringstream arch;
+				a.set_threads_cnt(threads_cnt);
+				HuffFileData y = a.archive(src_data, arch);
+				CHECK(arch.str() == expected.str());
+				CHECK(x.output_sz == y.output_sz);
+				CHECK(x.additional_sz == y.additional_sz);
+
+				// the chunks are stitched into memory that isn't zeroed
+				vector <unsigned char> arch_mem;
+				a.archive(src_data, [&arch_mem](size_t sz) {
+					arch_mem.assign(sz, UCHAR_MAX);
+					return std::span <unsigned char> (arch_mem);
+				});
+				CHECK(string(arch_mem.begin(), arch_mem.end()) == expected.str());
+			}
+		}
+	}
+
+	TEST_CASE("test blocks index") {
+		HuffmanArchiver a;
+		a.set_format(ArchiveFormat::BLOCKS);
+		a.set_block_sz(100);
+		string text = string(1000, 'x') + "Hello, World!";
+		stringstream src(text), arch;
+		a.archive(src, arch);
+		string s = arch.str();
+
+		auto dearchive_memory = [](const string &archive) {
+			vector <unsigned char> res_mem;
+			HuffmanDearchiver d;
+			d.dearchive(std::span <const unsigned char> ((const unsigned char*)archive.data(), archive.size()), [&res_mem](size_t sz) {
+				res_mem.resize(sz);
+				return std::span <unsigned char> (res_mem);
+			});
+			return string(res_mem.begin(), res_mem.end());
+		};
+
+		// the index is part of the format, archives without it are broken
+		const size_t trailer_sz = huffman::BLOCKS_INDEX_SIZE_BYTES + huffman::ARCHIVE_MAGIC_SZ;
+		size_t index_sz = (unsigned char)s[s.size() - trailer_sz];
+		string no_index = s.substr(0, s.size() - trailer_sz - index_sz);
+		CHECK(no_index.back() == 0);
+		CHECK_THROWS_WITH_AS(dearchive_memory(no_index), "error while reading block index", invalid_file_format);
+		stringstream no_index_in(no_index), res;
+		HuffmanDearchiver d;
+		CHECK_THROWS_WITH_AS(d.dearchive(no_index_in, res), "error while reading block index", invalid_file_format);
+
+		// index entries are the block sizes and chars counts, the last block has 13 chars
+		string bad = s;
+		bad[s.size() - trailer_sz - 1]++;
+		CHECK_THROWS_WITH_AS(dearchive_memory(bad), "error while reading block index", invalid_file_format);
+		stringstream bad_in(bad);
+		CHECK_THROWS_WITH_AS(d.dearchive(bad_in, res), "error while reading block index", invalid_file_format);
+
+		bad = s;
+		bad[s.size() - trailer_sz]++;
+		CHECK_THROWS_AS(dearchive_memory(bad), invalid_file_format);
+		CHECK_THROWS_AS(dearchive_memory(s + "x"), invalid_file_format);
+		CHECK_THROWS_AS(dearchive_memory(no_index + "x"), invalid_file_format);
+	}
+
+	TEST_CASE("test non-seekable input") {
+		// a pipe: chars can be read only once
+		struct PipeBuf : std::streambuf {
+			PipeBuf(string &s) {
+				setg(s.data(), s.data(), s.data() + s.size());
+			}
+		};
+		string text = string(1000, 'x') + "Hello, World!";
+
+		for (ArchiveFormat format : {ArchiveFormat::LEGACY, ArchiveFormat::CANONICAL}) {
+			HuffmanArchiver a;
+			a.set_format(format);
+			PipeBuf buf(text);
+			istream src(&buf);
+			stringstream arch;
+			CHECK_THROWS_AS(a.archive(src, arch), invalid_argument);
+		}
+
+		for (ArchiveFormat format : {ArchiveFormat::BLOCKS, ArchiveFormat::INTERLEAVED}) {
+			HuffmanArchiver a;
+			a.set_format(format);
+			a.set_block_sz(100);
+			PipeBuf buf(text);
+			istream src(&buf);
+			stringstream arch;
+			HuffFileData x = a.archive(src, arch);
+			CHECK(x.input_sz == text.size());
+
+			string s = arch.str();
+			PipeBuf arch_buf(s);
+			istream arch_in(&arch_buf);
+			stringstream res;
+			HuffmanDearchiver d;
+			d.dearchive(arch_in, res);
+			CHECK(res.str() == text);
+		}
+
+		// the batch read from a stream doesn't grow with the number of threads
+		struct CountingBuf : PipeBuf {
+			size_t max_read = 0;
+			CountingBuf(string &s) : PipeBuf(s) {}
+			std::streamsize xsgetn(char *s, std::streamsize n) override {
+				max_read = std::max(max_read, (size_t)n);
+				return PipeBuf::xsgetn(s, n);
+			}
+		};
+		string big = string(5000, 'x') + text;
+		HuffmanArchiver a;
+		a.set_format(ArchiveFormat::BLOCKS);
+		a.set_block_sz(100);
+		a.set_threads_cnt(64);
+		CountingBuf buf(big);
+		istream src(&buf);
+		stringstream arch;
+		CHECK(a.archive(src, arch).input_sz == big.size());
+		CHECK(buf.max_read <= 800);
+	}
+
+	// feeds the archive and takes the output in pieces of random sizes up to max_piece_sz
+	string dearchive_incrementally(const string &archive, size_t max_piece_sz, mt19937 &mtw, HuffFileData &data) {
+		huffman::IncrementalDearchiver d;
+		string res;
+		vector <unsigned char> out(max_piece_sz);
+		for (size_t pos = 0; pos < archive.size() || !d.done(); ) {
+			size_t in_sz = std::min(archive.size() - pos, (size_t)mtw() % max_piece_sz + 1);
+			size_t out_sz = mtw() % max_piece_sz + 1;
+			auto progress = d.decode(std::span <const unsigned char> ((const unsigned char*)archive.data() + pos, in_sz), std::span <unsigned char> (out.data(), out_sz));
+			res.append(out.begin(), out.begin() + progress.out_used);
+			pos += progress.in_used;
+			if (progress.in_used == 0 && progress.out_used == 0) {
+				break;
+			}
+		}
+		data = d.finish();
+		return res;
+	}
+
+	TEST_CASE("test incremental dearchive") {
+		mt19937 mtw(48);
+		string s;
+		for (size_t i = 0; i < 100000; i++) {
+			// a skewed part for codes longer than the decoding tables
+			s.push_back(i < 30000 ? 'a' + std::countr_zero((unsigned)mtw() | (1u << 20)) : mtw() % 256);
+		}
+
+		for (ArchiveFormat format : {ArchiveFormat::LEGACY, ArchiveFormat::CANONICAL, ArchiveFormat::BLOCKS, ArchiveFormat::INTERLEAVED, ArchiveFormat::ADAPTIVE, ArchiveFormat::PERIODIC}) {
+			for (const string &text : {string(), string("a"), string("Hello, World!"), s}) {
+				HuffmanArchiver a;
+				a.set_format(format);
+				a.set_block_sz(20000);
+				a.set_window_sz(20000);
+				stringstream src(text), arch, res;
+				a.archive(src, arch);
+				string archive = arch.str();
+				HuffmanDearchiver d;
+				HuffFileData expected = d.dearchive(arch, res);
+
+				for (size_t max_piece_sz : {1, 100, 100000}) {
+					HuffFileData data;
+					CHECK(dearchive_incrementally(archive, max_piece_sz, mtw, data) == text);
+					CHECK(data.input_sz == expected.input_sz);
+					CHECK(data.output_sz == expected.output_sz);
+					CHECK(data.additional_sz == expected.additional_sz);
+				}
+
+				// a cut archive is noticed at the end of input
+				if (!text.empty()) {
+					HuffFileData data;
+					CHECK_THROWS_AS(dearchive_incrementally(archive.substr(0, archive.size() / 2), 1000, mtw, data), invalid_file_format);
+				}
+			}
+		}
+
+		// the input is taken only as far as the output goes
+		HuffmanArchiver a;
+		stringstream src(s), arch;
+		a.archive(src, arch);
+		string archive = arch.str();
+		huffman::IncrementalDearchiver d;
+		unsigned char ch;
+		auto progress = d.decode(std::span <const unsigned char> ((const unsigned char*)archive.data(), archive.size()), std::span <unsigned char> (&ch, 1));
+		CHECK(progress.out_used == 1);
+		CHECK(ch == (unsigned char)s[0]);
+		CHECK(progress.in_used < archive.size());
+		CHECK(!d.done());
+		CHECK_THROWS_WITH_AS(d.finish(), "too few bits in input file", invalid_file_format);
+	}
+
+	TEST_CASE("test incremental dearchiver moved mid-stream") {
+		mt19937 mtw(49);
+		string s;
+		for (size_t i = 0; i < 50000; i++) {
+			s.push_back('a' + std::countr_zero((unsigned)mtw() | (1u << 20)));
+		}
+
+		for (ArchiveFormat format : {ArchiveFormat::CANONICAL, ArchiveFormat::PERIODIC}) {
+			HuffmanArchiver a;
+			a.set_format(format);
+			stringstream src(s), arch;
+			a.archive(src, arch);
+			string archive = arch.str();
+			std::span <const unsigned char> in((const unsigned char*)archive.data(), archive.size());
+			vector <unsigned char> out(s.size());
+
+			vector <huffman::IncrementalDearchiver> v(1);
+			auto progress = v[0].decode(in.first(archive.size() / 2), out);
+			// the copy and the moved one both go on without the tree of the first
+			huffman::IncrementalDearchiver copy = v[0];
+			v.emplace_back();
+			for (huffman::IncrementalDearchiver *d : {&v[0], &copy}) {
+				auto rest = d->decode(in.subspan(progress.in_used), std::span(out).subspan(progress.out_used));
+				CHECK(progress.out_used + rest.out_used == s.size());
+				CHECK(string(out.begin(), out.end()) == s);
+				CHECK(d->finish().output_sz == s.size());
+			}
+		}
+	}
+
+	TEST_CASE("test incremental dearchive of bad archives") {
+		mt19937 mtw(49);
+		HuffmanArchiver a;
+		a.set_format(ArchiveFormat::BLOCKS);
+		a.set_block_sz(100);
+		stringstream src(string(1000, 'x') + "Hello, World!"), arch;
+		a.archive(src, arch);
+		string s = arch.str();
+
+		HuffFileData data;
+		CHECK_THROWS_WITH_AS(dearchive_incrementally(s + "x", 10, mtw, data), "error while reading block index", invalid_file_format);
+		const size_t trailer_sz = huffman::BLOCKS_INDEX_SIZE_BYTES + huffman::ARCHIVE_MAGIC_SZ;
+		size_t index_sz = (unsigned char)s[s.size() - trailer_sz];
+		CHECK_THROWS_WITH_AS(dearchive_incrementally(s.substr(0, s.size() - trailer_sz - index_sz), 10, mtw, data), "error while reading block index", invalid_file_format);
+		CHECK_THROWS_WITH_AS(dearchive_incrementally("", 10, mtw, data), "error while reading archive header", invalid_file_format);
+		string bad = s;
+		bad[huffman::ARCHIVE_MAGIC_SZ] = 100;
+		CHECK_THROWS_WITH_AS(dearchive_incrementally(bad, 10, mtw, data), "unknown archive format version", invalid_file_format);
+
+		for (size_t i = 0; i < 100; i++) {
+			bad = s;
+			bad[mtw() % bad.size()] ^= 1 << (mtw() % CHAR_BIT);
+			try {
+				dearchive_incrementally(bad, 10, mtw, data);
+			} catch (invalid_file_format &e) {
+			}
+		}
+	}
+
+	TEST_CASE("test stored blocks") {
+		// text blocks are coded and random ones are stored as they are
+		mt19937 mtw(55);
+		string s;
+		for (size_t i = 0; i < 10000; i++) {
+			s.push_back(i / 1000 % 2 ? mtw() % 256 : 'a' + mtw() % 4);
+		}
+		for (ArchiveFormat format : {ArchiveFormat::BLOCKS, ArchiveFormat::INTERLEAVED}) {
+			HuffmanArchiver a;
+			a.set_format(format);
+			a.set_block_sz(1000);
+			stringstream src(s), arch;
+			HuffFileData x = a.archive(src, arch);
+			string archive = arch.str();
+			// the random half is stored, and the text half takes 2 bits a char
+			CHECK(x.output_sz >= s.size() / 2 + s.size() / 8);
+			CHECK(x.output_sz <= s.size() / 2 + s.size() / 8 + 10);
+
+			HuffmanDearchiver d;
+			stringstream in(archive), res;
+			HuffFileData y = d.dearchive(in, res);
+			CHECK(res.str() == s);
+			CHECK(y.input_sz == x.output_sz);
+			CHECK(y.additional_sz == x.additional_sz);
+
+			vector <unsigned char> res_mem;
+			HuffFileData y_mem = d.dearchive(std::span <const unsigned char> ((const unsigned char*)archive.data(), archive.size()), [&res_mem](size_t sz) {
+				res_mem.resize(sz);
+				return std::span <unsigned char> (res_mem);
+			});
+			CHECK(string(res_mem.begin(), res_mem.end()) == s);
+			CHECK(y_mem.input_sz == x.output_sz);
+
+			HuffFileData data;
+			CHECK(dearchive_incrementally(archive, 100, mtw, data) == s);
+			CHECK(data.input_sz == x.output_sz);
+		}
+
+		// a block of random chars is never coded longer than it is
+		string random;
+		for (size_t i = 0; i < 5000; i++) {
+			random.push_back(mtw() % 256);
+		}
+		HuffFileData x = check_round_trip(random, ArchiveFormat::BLOCKS);
+		CHECK(x.output_sz == random.size());
+
+		HuffmanDearchiver d;
+		string bad = string("HUFF") + (char)ArchiveFormat::BLOCKS + (char)5 + (char)huffman::BLOCK_STORED + "abcd";
+		stringstream in(bad), res;
+		CHECK_THROWS_WITH_AS(d.dearchive(in, res), "too few bits in input file", invalid_file_format);
+	}
+
+	TEST_CASE("test canonical header is smaller") {
+		string s = "ahahahahahahahhahahahahahahahahahahahaha";
+		HuffFileData legacy = check_round_trip(s, ArchiveFormat::LEGACY);
+		HuffFileData canonical = check_round_trip(s, ArchiveFormat::CANONICAL);
+
+		CHECK(canonical.output_sz <= legacy.output_sz);
+		CHECK(canonical.additional_sz < legacy.additional_sz);
+	}
+
+	TEST_CASE("test canonical header of sparse files") {
+		HuffFileData x = check_round_trip("a", ArchiveFormat::CANONICAL);
+		CHECK(x.additional_sz < 16);
+
+		string s;
+		for (size_t i = 0; i < 1000; i++) {
+			s.push_back(' ' + i * i % 95);
+		}
+		x = check_round_trip(s, ArchiveFormat::CANONICAL);
+		CHECK(x.additional_sz < 96);
+	}
+
+	TEST_CASE("test bad canonical archives") {
+		stringstream src("Hello, World!"), arch;
+
+		HuffmanArchiver a;
+		a.set_format(ArchiveFormat::CANONICAL);
+		a.archive(src, arch);
+		string good = arch.str();
+
+		for (size_t len = 0; len < good.size(); len++) {
+			stringstream cut(good.substr(0, len)), res;
+			HuffmanDearchiver d;
+			CHECK_THROWS_AS(d.dearchive(cut, res), invalid_file_format);
+		}
+
+		string bad_version = good;
+		bad_version[huffman::ARCHIVE_MAGIC_SZ] = 77;
+		stringstream bad(bad_version), res;
+		HuffmanDearchiver d;
+		CHECK_THROWS_WITH_AS(d.dearchive(bad, res), "unknown archive format version", invalid_file_format);
+	}
+
 	TEST_CASE("test 100 bad archives") {
 		const int N = 5017;
 		mt19937 mtw(17);
@@ -1114,4 +2843,97 @@ TEST_SUITE("test HuffmanArchiver and HuffmanDearchiver") {
 			CHECK_THROWS_WITH_AS(d.dearchive(arch, res), "too few bits in input file", invalid_file_format);
 		}
 	}
+}
+
+TEST_SUITE("test MappedFile") {
+	TEST_CASE("test mapping") {
+		std::filesystem::path path = std::filesystem::temp_directory_path() / "hw_02_mapped_file_test";
+		string s = "Hello, mapped world!";
+		{
+			std::ofstream out(path, std::ios::binary);
+			out << s;
+		}
+
+		{
+			MappedFile f(path.c_str());
+			REQUIRE(f.is_mapped());
+			CHECK(string((const char*)f.get_data().data(), f.get_data().size()) == s);
+		}
+
+		{
+			std::ofstream out(path, std::ios::binary | std::ios::trunc);
+		}
+		CHECK(!MappedFile(path.c_str()).is_mapped());
+
+		std::filesystem::remove(path);
+		CHECK(!MappedFile(path.c_str()).is_mapped());
+	}
+
+	TEST_CASE("test non-regular files aren't mapped") {
+		CHECK(!MappedFile(std::filesystem::temp_directory_path().c_str()).is_mapped());
+		CHECK(!MappedFile("/dev/null").is_mapped());
+		CHECK(!MappedOutputFile(std::filesystem::temp_directory_path().c_str()).is_open());
+		CHECK(!MappedOutputFile("/dev/null").is_open());
+	}
+
+	TEST_CASE("test mapped output") {
+		std::filesystem::path path = std::filesystem::temp_directory_path() / "hw_02_mapped_output_test";
+		{
+			std::ofstream out(path, std::ios::binary);
+			out << "some old content that is longer";
+		}
+
+		{
+			MappedOutputFile f(path.c_str());
+			REQUIRE(f.is_open());
+			std::span <unsigned char> data = f.map(10);
+			REQUIRE(data.size() == 10);
+			std::memcpy(data.data(), "Hello, mapped", 10);
+			f.close(5);
+		}
+		CHECK(std::filesystem::file_size(path) == 5);
+		{
+			MappedFile f(path.c_str());
+			REQUIRE(f.is_mapped());
+			CHECK(string((const char*)f.get_data().data(), 5) == "Hello");
+		}
+
+		{
+			MappedOutputFile f(path.c_str());
+			CHECK(f.map(0).empty());
+			f.close(0);
+		}
+		CHECK(std::filesystem::file_size(path) == 0);
+		std::filesystem::remove(path);
+	}
+}
+
+TEST_SUITE("test parallel") {
+	TEST_CASE("test parallel_for") {
+		for (size_t threads_cnt : {0, 1, 3, 16}) {
+			vector <size_t> visits(1000);
+			parallel::parallel_for(visits.size(), threads_cnt, [&visits](size_t i) {
+				visits[i]++;
+			});
+			CHECK(std::count(visits.begin(), visits.end(), 1) == (long)visits.size());
+		}
+		parallel::parallel_for(0, 4, [](size_t) {
+			CHECK(0);
+		});
+	}
+
+	TEST_CASE("test parallel_for exceptions") {
+		for (size_t threads_cnt : {1, 4}) {
+			std::atomic <size_t> calls(0);
+			CHECK_THROWS_WITH_AS(parallel::parallel_for(1000, threads_cnt, [&calls](size_t i) {
+				calls++;
+				if (i == 10) {
+					throw std::runtime_error("failed");
+				}
+			}), "failed", std::runtime_error);
+			if (threads_cnt == 1) {
+				CHECK(calls == 11);
+			}
+		}
+	}
 }
\ No newline at end of file